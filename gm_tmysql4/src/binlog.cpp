@@ -0,0 +1,301 @@
+#include "gm_tmysql.h"
+
+#include <cstring>
+
+#define BINLOG_HEADER_SIZE 19
+#define BINLOG_RETRY_SECONDS 5
+
+// The event types we look at, from the replication protocol
+enum
+{
+	BINLOG_QUERY_EVENT = 2,
+	BINLOG_TABLE_MAP_EVENT = 19,
+	BINLOG_WRITE_ROWS_EVENT_V1 = 23,
+	BINLOG_UPDATE_ROWS_EVENT_V1 = 24,
+	BINLOG_DELETE_ROWS_EVENT_V1 = 25,
+	BINLOG_WRITE_ROWS_EVENT = 30,
+	BINLOG_UPDATE_ROWS_EVENT = 31,
+	BINLOG_DELETE_ROWS_EVENT = 32,
+};
+
+static unsigned long long ReadLittleEndian(const unsigned char* data, int bytes)
+{
+	unsigned long long value = 0;
+	for (int i = bytes - 1; i >= 0; i--)
+		value = (value << 8) | data[i];
+	return value;
+}
+
+#ifdef BINLOG_PROTOCOL_INTERNALS
+static void WriteLittleEndian(unsigned char* data, unsigned long long value, int bytes)
+{
+	for (int i = 0; i < bytes; i++, value >>= 8)
+		data[i] = (unsigned char)(value & 0xFF);
+}
+#endif
+
+BinlogListener::BinlogListener(unsigned int serverid, const ConnectFunc& connect, const ChangeFunc& change, const ErrorFunc& error) :
+	m_iServerID(serverid), m_connect(connect), m_change(change), m_error(error), m_bStop(false)
+{
+}
+
+BinlogListener::~BinlogListener(void)
+{
+	Stop();
+}
+
+void BinlogListener::Start(void)
+{
+	m_thread = std::thread(std::bind(&BinlogListener::Run, this));
+}
+
+void BinlogListener::Stop(void)
+{
+	if (!m_thread.joinable())
+		return;
+
+	{
+		std::lock_guard<std::mutex> guard(m_Mutex);
+		m_bStop = true;
+	}
+	m_CV.notify_all();
+
+	// Killing the dump would need another connection to a server that may be unreachable. Every read wakes up
+	// within BINLOG_READ_TIMEOUT, with a heartbeat or a timeout, and sees m_bStop.
+	m_thread.join();
+}
+
+void BinlogListener::Run(void)
+{
+	while (!m_bStop)
+	{
+		std::string error;
+		int errorid = CR_CONN_HOST_ERROR;
+
+		MYSQL* mysql = m_connect(error);
+		if (mysql)
+		{
+			// Whatever happened while we weren't following is unknown
+			m_change("", "");
+
+			if (!m_bStop && !Follow(mysql, errorid, error) && !m_bStop)
+				m_error(errorid, error);
+
+			mysql_close(mysql);
+		}
+		else
+			m_error(errorid, error);
+
+		std::unique_lock<std::mutex> lock(m_Mutex);
+		m_CV.wait_for(lock, std::chrono::seconds(BINLOG_RETRY_SECONDS), [&]() { return m_bStop.load(); });
+	}
+}
+
+// Only returns once the connection fails or we're stopped
+bool BinlogListener::Follow(MYSQL* mysql, int& errorid, std::string& error)
+{
+	// Servers logging checksums refuse replicas that don't claim to handle them, older ones don't know the variable
+	mysql_query(mysql, "SET @master_binlog_checksum = @@global.binlog_checksum");
+
+	// Heartbeat events keep the reads below from timing out while nothing is written, in nanoseconds
+	char heartbeat[64];
+	snprintf(heartbeat, sizeof(heartbeat), "SET @master_heartbeat_period = %llu", BINLOG_HEARTBEAT_SECONDS * 1000000000ULL);
+	if (mysql_query(mysql, heartbeat) != 0)
+	{
+		errorid = mysql_errno(mysql);
+		error.assign(mysql_error(mysql));
+		return false;
+	}
+
+	if (mysql_query(mysql, "SHOW MASTER STATUS") != 0)
+	{
+		errorid = mysql_errno(mysql);
+		error.assign(mysql_error(mysql));
+		return false;
+	}
+
+	MYSQL_RES* result = mysql_store_result(mysql);
+	MYSQL_ROW row = result ? mysql_fetch_row(result) : NULL;
+
+	if (row == NULL || row[0] == NULL || row[1] == NULL)
+	{
+		if (result)
+			mysql_free_result(result);
+
+		errorid = CR_UNKNOWN_ERROR;
+		error.assign("Binary logging is disabled on the server");
+		return false;
+	}
+
+	// Start at the end, only changes from now on matter
+	std::string file(row[0]);
+	unsigned long long position = strtoull(row[1], NULL, 10);
+	mysql_free_result(result);
+
+#if defined(BINLOG_PUBLIC_API)
+	MYSQL_RPL rpl;
+	memset(&rpl, 0, sizeof(rpl));
+	rpl.file_name_length = file.length();
+	rpl.file_name = file.c_str();
+	rpl.start_position = position;
+	rpl.server_id = m_iServerID;
+
+	if (mysql_binlog_open(mysql, &rpl) != 0)
+	{
+		errorid = mysql_errno(mysql);
+		error.assign(mysql_error(mysql));
+		return false;
+	}
+
+	while (!m_bStop)
+	{
+		if (mysql_binlog_fetch(mysql, &rpl) != 0)
+		{
+			errorid = mysql_errno(mysql);
+			error.assign(mysql_error(mysql));
+			return false;
+		}
+
+		if (rpl.size == 0)
+		{
+			errorid = CR_SERVER_LOST;
+			error.assign("The server ended the binary log");
+			return false;
+		}
+
+		// Same packets as below, behind the OK marker
+		HandleEvent(rpl.buffer + 1, rpl.size - 1);
+	}
+
+	return true;
+#elif defined(BINLOG_PROTOCOL_INTERNALS)
+	// COM_BINLOG_DUMP: position, flags, server id, file name
+	std::string packet(10 + file.length(), '\0');
+	unsigned char* data = (unsigned char*)&packet[0];
+	WriteLittleEndian(data, position, 4);
+	WriteLittleEndian(data + 4, 0, 2);
+	WriteLittleEndian(data + 6, m_iServerID, 4);
+	memcpy(data + 10, file.data(), file.length());
+
+	net_clear(&mysql->net, 1);
+	if (net_write_command(&mysql->net, COM_BINLOG_DUMP, NULL, 0, data, packet.length()))
+	{
+		errorid = CR_SERVER_LOST;
+		error.assign("Unable to request the binary log");
+		return false;
+	}
+
+	while (!m_bStop)
+	{
+		unsigned long length = my_net_read(&mysql->net);
+		if (length == packet_error || length == 0)
+		{
+			errorid = CR_SERVER_LOST;
+			error.assign("Lost the binary log connection");
+			return false;
+		}
+
+		const unsigned char* read = mysql->net.read_pos;
+
+		if (read[0] == 0xFF)
+		{
+			errorid = length >= 3 ? (int)ReadLittleEndian(read + 1, 2) : CR_UNKNOWN_ERROR;
+
+			// Skip the #SQLSTATE marker when there is one
+			size_t offset = length > 9 && read[3] == '#' ? 9 : 3;
+			error.assign((const char*)read + offset, length > offset ? length - offset : 0);
+			return false;
+		}
+
+		if (read[0] == 0xFE && length < 8)
+		{
+			errorid = CR_SERVER_LOST;
+			error.assign("The server ended the binary log");
+			return false;
+		}
+
+		HandleEvent(read + 1, length - 1);
+	}
+
+	return true;
+#else
+	errorid = CR_UNKNOWN_ERROR;
+	error.assign("This client library can't follow the binary log");
+	return false;
+#endif
+}
+
+void BinlogListener::HandleEvent(const unsigned char* event, unsigned long length)
+{
+	if (length < BINLOG_HEADER_SIZE)
+		return;
+
+	unsigned char type = event[4];
+	const unsigned char* body = event + BINLOG_HEADER_SIZE;
+	unsigned long size = length - BINLOG_HEADER_SIZE;
+
+	switch (type)
+	{
+	case BINLOG_TABLE_MAP_EVENT:
+	{
+		// table id (6), flags (2), db length (1), db, 0, table length (1), table, 0
+		if (size < 10)
+			return;
+
+		unsigned long long id = ReadLittleEndian(body, 6);
+		unsigned long dblength = body[8];
+		if (10 + dblength + 1 > size)
+			return;
+
+		unsigned long tablelength = body[10 + dblength];
+		if (11 + dblength + tablelength > size)
+			return;
+
+		std::pair<std::string, std::string>& table = m_tables[id];
+		table.first.assign((const char*)body + 9, dblength);
+		table.second.assign((const char*)body + 11 + dblength, tablelength);
+		break;
+	}
+
+	case BINLOG_WRITE_ROWS_EVENT_V1:
+	case BINLOG_UPDATE_ROWS_EVENT_V1:
+	case BINLOG_DELETE_ROWS_EVENT_V1:
+	case BINLOG_WRITE_ROWS_EVENT:
+	case BINLOG_UPDATE_ROWS_EVENT:
+	case BINLOG_DELETE_ROWS_EVENT:
+	{
+		if (size < 6)
+			return;
+
+		auto it = m_tables.find(ReadLittleEndian(body, 6));
+		if (it != m_tables.end())
+			m_change(it->second.first, it->second.second);
+		else
+			m_change("", "");
+		break;
+	}
+
+	case BINLOG_QUERY_EVENT:
+	{
+		// thread id (4), exec time (4), db length (1), error (2), status length (2), status, db, 0, query
+		if (size < 13)
+			return;
+
+		unsigned long dblength = body[8];
+		unsigned long statuslength = (unsigned long)ReadLittleEndian(body + 11, 2);
+		unsigned long offset = 13 + statuslength + dblength + 1;
+		if (offset > size)
+			return;
+
+		// Transaction markers around row events, no data changes by themselves
+		const char* query = (const char*)body + offset;
+		size_t querylength = size - offset;
+		if ((querylength >= 5 && strncmp(query, "BEGIN", 5) == 0) || (querylength >= 6 && strncmp(query, "COMMIT", 6) == 0))
+			return;
+
+		// DDL and statement based changes, no telling which tables they touched
+		m_change("", "");
+		break;
+	}
+	}
+}
\ No newline at end of file
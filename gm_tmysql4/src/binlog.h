@@ -0,0 +1,59 @@
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+// mysql_binlog_open and friends are public since 5.7. Older client libraries only have the protocol internals,
+// which the Linux libmysqlclient links but Windows' libmysql.dll doesn't export.
+#if MYSQL_VERSION_ID >= 50709
+#define BINLOG_PUBLIC_API
+#elif !defined(_WIN32)
+#define BINLOG_PROTOCOL_INTERNALS
+#endif
+
+#if defined(BINLOG_PUBLIC_API) || defined(BINLOG_PROTOCOL_INTERNALS)
+#define BINLOG_SUPPORTED
+#endif
+
+#define BINLOG_HEARTBEAT_SECONDS 1	// Asked of the server while the log is quiet
+#define BINLOG_READ_TIMEOUT 3		// Seconds, connecting and waiting on the dump connection
+
+// Follows the server's binary log the way a replica does and reports the tables row events touch.
+// Runs on its own thread, the dump is one endless read woken by heartbeats. Needs REPLICATION SLAVE and
+// REPLICATION CLIENT, and binlog_format=ROW for exact tables. Statement events and reconnects
+// can't be attributed to a table and are reported with an empty table, meaning anything may have changed.
+class BinlogListener
+{
+public:
+	typedef std::function<MYSQL*(std::string& error)> ConnectFunc;
+	typedef std::function<void(const std::string& db, const std::string& table)> ChangeFunc;
+	typedef std::function<void(int errorid, const std::string& error)> ErrorFunc;
+
+	// serverid has to be unique among everything replicating from the server
+	BinlogListener(unsigned int serverid, const ConnectFunc& connect, const ChangeFunc& change, const ErrorFunc& error);
+	~BinlogListener(void);
+
+	void			Start(void);
+	void			Stop(void);
+
+private:
+	void			Run(void);
+	bool			Follow(MYSQL* mysql, int& errorid, std::string& error);
+	void			HandleEvent(const unsigned char* event, unsigned long length);
+
+	unsigned int	m_iServerID;
+	ConnectFunc		m_connect;
+	ChangeFunc		m_change;
+	ErrorFunc		m_error;
+
+	std::atomic<bool> m_bStop;
+	std::mutex		m_Mutex;
+	std::condition_variable m_CV;
+	std::thread		m_thread;
+
+	// TABLE_MAP ids to db and table, only touched by the listener thread
+	std::unordered_map<unsigned long long, std::pair<std::string, std::string> > m_tables;
+};
\ No newline at end of file
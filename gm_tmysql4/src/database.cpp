@@ -1,9 +1,23 @@
 #include "gm_tmysql.h"
 
+#ifndef _WIN32
+#include <sys/socket.h>
+#endif
+
 Database::Database(const char* host, const char* user, const char* pass, const char* db, int port, const char* socket, int flags) :
-m_strHost(host), m_strUser(user), m_strPass(pass), m_strDB(db), m_iPort(port), m_strSocket(socket), m_iClientFlags(flags), m_pEscapeConnection(NULL)
+m_pEscapeConnection(NULL), m_pDeferredCompleted(NULL), m_iDispatchDepth(0), m_bDisconnected(false),
+m_iNumConnections(NUM_CON_DEFAULT), m_iPoolSize(0), m_iPendingConnects(0), m_iFailedConnects(0),
+m_bConnectReported(false), m_iConnectCallback(-1), m_iTasks(0), m_pKillConnection(NULL),
+m_iRunning(0), m_bConnectFailed(false), m_iMaxQueries(0), m_iMaxQueuedBytes(0),
+m_iBackpressurePolicy(BACKPRESSURE_REJECT), m_iInFlight(0), m_iQueuedBytes(0), m_iRejected(0), m_iDropped(0),
+m_bCoalesceReads(false), m_iCoalesced(0), m_iNextQueryID(0), m_bWriteBehind(false), m_iWriteMaxStatements(100),
+m_iWriteMaxBytes(65536), m_dWriteInterval(1), m_iWriteBufferBytes(0), m_bFlushingWrites(false), m_dWriteBackoff(0),
+m_pWriteConnection(NULL), m_iWritesFlushed(0), m_iWriteBatches(0), m_pBinlog(NULL), m_iCacheGeneration(0),
+m_iCacheCleared(0), m_dUpsertInterval(1), m_iUpsertsSaved(0), m_dSlowQueryThreshold(0), m_bExplainSlowQueries(false),
+m_bShuttingDown(false), m_bShutdownDeadline(false), m_bAbandoned(false), m_iReadTimeout(0), m_iWriteTimeout(0), m_dQueryTimeout(0),
+m_strHost(host), m_strUser(user), m_strPass(pass), m_strDB(db), m_iPort(port), m_strSocket(socket ? socket : ""),
+m_bHasSocket(socket != NULL), m_iClientFlags(flags)
 {
-	work.reset(new asio::io_service::work(io_service));
 }
 
 Database::~Database( void )
@@ -12,39 +26,158 @@ Database::~Database( void )
 
 bool Database::Initialize(std::string& error)
 {
-	static my_bool bTrue = true;
+	StartConnecting();
+
+	std::unique_lock<std::mutex> lock(m_AvailableMutex);
+	m_AvailableCV.wait(lock, [&]() { return m_iPendingConnects == 0; });
 
-	for (int i = NUM_CON_DEFAULT+1; i; i--)
+	if (m_iFailedConnects > 0)
 	{
-		MYSQL* mysql = mysql_init(NULL);
+		error.assign(m_strConnectError);
+		return false;
+	}
 
-		if (!Connect(mysql, error))
-			return false;
+	return true;
+}
+
+void Database::InitializeAsync(void)
+{
+	StartConnecting();
+}
+
+void Database::StartConnecting(void)
+{
+	sharedExecutor.Start();
+
+	m_iPendingConnects = m_iNumConnections + 1;
+
+	Post(sharedExecutor.GetWorkService(), std::bind(&Database::ConnectOne, this, true));
+
+	for (unsigned int i = 0; i < m_iNumConnections; ++i)
+		Post(sharedExecutor.GetWorkService(), std::bind(&Database::ConnectOne, this, false));
+
+	Post(sharedExecutor.GetKillService(), std::bind(&Database::ConnectKill, this));
+}
+
+void Database::Post(asio::io_service& service, const std::function<void()>& task)
+{
+	BeginTask();
+	service.post([this, task]()
+	{
+		task();
+		EndTask();
+	});
+}
+
+void Database::BeginTask(void)
+{
+	std::lock_guard<std::mutex> guard(m_TaskMutex);
+	m_iTasks++;
+}
+
+void Database::EndTask(void)
+{
+	// Notify under the lock, Shutdown may delete us as soon as it can take it
+	std::lock_guard<std::mutex> guard(m_TaskMutex);
+	m_iTasks--;
+	m_TaskCV.notify_all();
+}
+
+void Database::ConnectOne(bool escape)
+{
+	std::string error;
+	MYSQL* mysql = mysql_init(NULL);
+	bool connected = Connect(mysql, error);
+	bool nopool = false;
+	bool finished = false;
+
+	if (!connected)
+		mysql_close(mysql);
+
+	{
+		std::lock_guard<std::mutex> guard(m_AvailableMutex);
 
-		if (i > NUM_CON_DEFAULT)
+		if (!connected)
+		{
+			m_iFailedConnects++;
+			m_strConnectError.assign(error);
+		}
+		else if (escape)
 			m_pEscapeConnection = mysql;
 		else
+		{
 			m_vecAvailableConnections.push_back(mysql);
+			m_iPoolSize++;
+		}
+
+		m_iPendingConnects--;
+		finished = m_iPendingConnects == 0;
+		nopool = finished && m_iPoolSize == 0;
 	}
 
-	for (unsigned int i = 0; i < NUM_THREADS_DEFAULT; ++i)
+	m_AvailableCV.notify_all();
+
+	// The connect callback is waiting on this
+	if (finished)
+		completionWakeup.Notify();
+
+	if (connected && !escape)
 	{
-		thread_group.push_back(std::thread(
-			[&]()
+		std::lock_guard<std::mutex> guard(m_PendingMutex);
+		Schedule();
+	}
+	else if (nopool)
+	{
+		// Nothing will ever pick up what was queued meanwhile
+		std::vector<Query*> failed;
 		{
-			io_service.run();
-		}));
+			std::lock_guard<std::mutex> guard(m_PendingMutex);
+			m_bConnectFailed = true;
+			TakePending(failed);
+		}
+		m_PendingCV.notify_all();
+
+		for (auto iter = failed.begin(); iter != failed.end(); ++iter)
+			FailQuery(*iter, CR_CONN_HOST_ERROR, "Database failed to connect");
 	}
+}
+
+// Main thread, reports the outcome of connecting exactly once
+bool Database::PopConnectResult(bool& success, std::string& error)
+{
+	if (m_bConnectReported)
+		return false;
+
+	std::lock_guard<std::mutex> guard(m_AvailableMutex);
+
+	if (m_iPendingConnects > 0)
+		return false;
 
+	m_bConnectReported = true;
+	success = m_pEscapeConnection != NULL && m_iPoolSize > 0;
+	error.assign(m_strConnectError);
 	return true;
 }
 
-bool Database::Connect(MYSQL* mysql, std::string& error)
+bool Database::Connect(MYSQL* mysql, std::string& error, int extraflags, bool timeouts)
 {
 	my_bool reconnect = 1;
 	mysql_options(mysql, MYSQL_OPT_RECONNECT, &reconnect);
 
-	if (!mysql_real_connect(mysql, m_strHost, m_strUser, m_strPass, m_strDB, m_iPort, m_strSocket, m_iClientFlags))
+	if (timeouts && m_iReadTimeout > 0)
+		mysql_options(mysql, MYSQL_OPT_READ_TIMEOUT, &m_iReadTimeout);
+	if (timeouts && m_iWriteTimeout > 0)
+		mysql_options(mysql, MYSQL_OPT_WRITE_TIMEOUT, &m_iWriteTimeout);
+
+	// Connections opened later on (write-behind, kill, binlog) speak the same charset as the pool
+	{
+		std::lock_guard<std::mutex> guard(m_AvailableMutex);
+		if (!m_strCharset.empty())
+			mysql_options(mysql, MYSQL_SET_CHARSET_NAME, m_strCharset.c_str());
+	}
+
+	if (!mysql_real_connect(mysql, m_strHost.c_str(), m_strUser.c_str(), m_strPass.c_str(), m_strDB.c_str(), m_iPort,
+		m_bHasSocket ? m_strSocket.c_str() : NULL, m_iClientFlags | extraflags))
 	{
 		error.assign(mysql_error(mysql));
 		return false;
@@ -52,44 +185,222 @@ bool Database::Connect(MYSQL* mysql, std::string& error)
 
 	return true;
 }
-void Database::Shutdown(void)
+
+void Database::BeginShutdown(double deadline)
 {
-	work.reset();
+	m_bShuttingDown = true;
 
-	for (auto iter = thread_group.begin(); iter != thread_group.end(); ++iter)
+	// Buffered writes go out ahead of everything else
+	FlushCoalesced(true);
+	ScheduleWriteFlush(true);
+
+	if (deadline >= 0)
 	{
-		iter->join();
-	}
+		m_bShutdownDeadline = true;
+		m_shutdownDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds((long long)(deadline * 1000));
 
-	assert(io_service.stopped());
-}
+		std::vector<Query*> dropped;
+		{
+			std::lock_guard<std::mutex> guard(m_PendingMutex);
 
-std::size_t Database::RunShutdownWork(void)
-{
-	io_service.reset();
-	return io_service.run();
+			for (auto iter = m_pendingQueries.begin(); iter != m_pendingQueries.end();)
+			{
+				Query* query = *iter;
+				if (query->IsDurable())
+				{
+					++iter;
+					continue;
+				}
+
+				m_iQueuedBytes -= query->GetQueryLength();
+				m_iInFlight--;
+				dropped.push_back(query);
+				iter = m_pendingQueries.erase(iter);
+			}
+
+			size_t heads = dropped.size();
+			for (auto lane = m_lanes.begin(); lane != m_lanes.end(); ++lane)
+			{
+				std::deque<Query*>& waiting = lane->second;
+				for (auto iter = waiting.begin(); iter != waiting.end();)
+				{
+					Query* query = *iter;
+					if (query->IsDurable())
+					{
+						++iter;
+						continue;
+					}
+
+					m_iQueuedBytes -= query->GetQueryLength();
+					m_iInFlight--;
+					dropped.push_back(query);
+					iter = waiting.erase(iter);
+				}
+			}
+
+			// Durable queries waiting behind a dropped head take its place
+			for (size_t i = 0; i < heads; i++)
+				ReleaseLane(dropped[i]);
+
+			Schedule();
+		}
+
+		for (auto iter = dropped.begin(); iter != dropped.end(); ++iter)
+		{
+			m_droppedOnShutdown.push_back((*iter)->GetQuery());
+			FailQuery(*iter, QUERY_ERROR_SHUTDOWN, "Database is shutting down");
+		}
+	}
 }
 
-void Database::Release(void)
+void Database::Shutdown(void)
 {
-	assert(io_service.stopped());
+	// Its errors are queued like any other, stop it before the last dispatch
+	if (m_pBinlog)
+		m_pBinlog->Stop();
 
-	for (auto iter = m_vecAvailableConnections.begin(); iter != m_vecAvailableConnections.end(); ++iter)
 	{
-		mysql_close(*iter);
+		std::unique_lock<std::mutex> lock(m_WriteMutex);
+		auto drained = [&]() { return m_writeBuffer.empty() && !m_bFlushingWrites; };
+
+		if (!m_bShutdownDeadline)
+			m_WriteCV.wait(lock, drained);
+		else if (!m_WriteCV.wait_until(lock, m_shutdownDeadline, drained))
+		{
+			// The batch being sent finishes on its own, whatever is still buffered is lost
+			m_droppedOnShutdown.insert(m_droppedOnShutdown.end(), m_writeBuffer.begin(), m_writeBuffer.end());
+			m_writeBuffer.clear();
+			m_iWriteBufferBytes = 0;
+		}
+	}
+
+	// An armed flush timer would otherwise keep us alive for up to a whole interval
+	Post(sharedExecutor.GetTimerService(), [this]()
+	{
+		if (m_writeTimer)
+			m_writeTimer->cancel();
+	});
+
+	if (!m_bShutdownDeadline)
+	{
+		std::unique_lock<std::mutex> lock(m_PendingMutex);
+		m_PendingCV.wait(lock, [&]() { return m_iInFlight == 0; });
+	}
+	else
+	{
+		std::vector<Query*> dropped;
+		{
+			std::unique_lock<std::mutex> lock(m_PendingMutex);
+
+			if (!m_PendingCV.wait_until(lock, m_shutdownDeadline, [&]() { return m_iInFlight == 0; }))
+			{
+				TakePending(dropped);
+			}
+		}
+
+		for (auto iter = dropped.begin(); iter != dropped.end(); ++iter)
+		{
+			m_droppedOnShutdown.push_back((*iter)->GetQuery());
+			FailQuery(*iter, QUERY_ERROR_SHUTDOWN, "Database is shutting down");
+		}
+
+		// Out of time, interrupt whatever is still running so the workers can let go of us
+		if (!dropped.empty() || m_iInFlight > 0)
+		{
+			std::lock_guard<std::mutex> guard(m_ActiveMutex);
+
+			for (auto iter = m_activeQueries.begin(); iter != m_activeQueries.end(); ++iter)
+			{
+				Query* query = iter->second;
+				if (query->GetThreadID() == 0)
+					continue;
+
+				query->SetCancelled();
+				m_droppedOnShutdown.push_back(query->GetQuery());
+				Post(sharedExecutor.GetKillService(), std::bind(&Database::KillQuery, this, query->GetID(), false));
+			}
+		}
+	}
+
+	// Connects, queries, kills and cancelled watchdog timers still hold on to us
+	std::unique_lock<std::mutex> lock(m_TaskMutex);
+	auto idle = [&]() { return m_iTasks == 0; };
+
+	if (!m_bShutdownDeadline)
+	{
+		m_TaskCV.wait(lock, idle);
+		return;
+	}
+
+	std::chrono::steady_clock::time_point grace = std::max(m_shutdownDeadline, std::chrono::steady_clock::now()) + std::chrono::seconds(SHUTDOWN_GRACE);
+	if (m_TaskCV.wait_until(lock, grace, idle))
+		return;
+
+	// A KILL that couldn't reach the server leaves its query blocked in a read, pull the socket out from under it
+	lock.unlock();
+	{
+		std::lock_guard<std::mutex> guard(m_ActiveMutex);
+
+		for (auto iter = m_activeQueries.begin(); iter != m_activeQueries.end(); ++iter)
+		{
+			MYSQL* mysql = iter->second->GetConnection();
+			if (mysql == NULL)
+				continue;
+
+#ifdef _WIN32
+			shutdown(mysql->net.fd, SD_BOTH);
+#else
+			shutdown(mysql->net.fd, SHUT_RDWR);
+#endif
+		}
 	}
+	lock.lock();
+
+	m_bAbandoned = !m_TaskCV.wait_until(lock, std::chrono::steady_clock::now() + std::chrono::seconds(SHUTDOWN_GRACE), idle);
+}
 
+void Database::Release(void)
+{
+	std::vector<MYSQL*> connections(m_vecAvailableConnections.begin(), m_vecAvailableConnections.end());
 	m_vecAvailableConnections.clear();
 
 	if (m_pEscapeConnection != NULL)
+		connections.push_back(m_pEscapeConnection);
+	if (m_pKillConnection != NULL)
+		connections.push_back(m_pKillConnection);
+	if (m_pWriteConnection != NULL)
+		connections.push_back(m_pWriteConnection);
+
+	m_pEscapeConnection = NULL;
+	m_pKillConnection = NULL;
+	m_pWriteConnection = NULL;
+	m_writeTimer.reset();
+
+	delete m_pBinlog;
+	m_pBinlog = NULL;
+
+	// mysql_close waits on COM_QUIT, don't pay that round trip once per connection
+	std::vector<std::thread> closers;
+	for (auto iter = connections.begin(); iter != connections.end(); ++iter)
 	{
-		mysql_close(m_pEscapeConnection);
-		m_pEscapeConnection = NULL;
+		MYSQL* mysql = *iter;
+		closers.push_back(std::thread([mysql]()
+		{
+			mysql_close(mysql);
+		}));
 	}
+
+	for (auto iter = closers.begin(); iter != closers.end(); ++iter)
+		iter->join();
 }
 
 char* Database::Escape(const char* query)
 {
+	std::lock_guard<std::mutex> guard(m_AvailableMutex);
+
+	if (m_pEscapeConnection == NULL)
+		return NULL;
+
 	size_t len = strlen(query);
 	char* escaped = new char[len * 2 + 1];
 
@@ -99,6 +410,14 @@ char* Database::Escape(const char* query)
 
 bool Database::SetCharacterSet(const char* charset, std::string& error)
 {
+	std::lock_guard<std::mutex> guard(m_AvailableMutex);
+
+	if (m_pEscapeConnection == NULL)
+	{
+		error.assign("Database is not connected");
+		return false;
+	}
+
 	if (mysql_set_character_set(m_pEscapeConnection, charset) > 0)
 	{
 		error.assign(mysql_error(m_pEscapeConnection));
@@ -114,56 +433,1831 @@ bool Database::SetCharacterSet(const char* charset, std::string& error)
 		}
 	}
 
+	m_strCharset.assign(charset);
 	return true;
 }
 
-void Database::QueueQuery(const char* query, int callback, int callbackref, bool usenumbers)
+bool Database::IsReadQuery(const char* query)
 {
-	Query* newquery = new Query(query, callback, callbackref, usenumbers);
+	while (isspace((unsigned char)*query))
+		query++;
+
+#ifdef _WIN32
+	return _strnicmp(query, "SELECT", 6) == 0;
+#else
+	return strncasecmp(query, "SELECT", 6) == 0;
+#endif
+}
+
+unsigned int Database::QueueQuery(const char* query, int callback, bool usenumbers, const QueryOptions& options)
+{
+	// Nobody is waiting on the outcome, failures go to the error handler
+	if (m_bWriteBehind && callback < 0 && options.lane.empty() && !IsReadQuery(query))
+	{
+		QueueWrite(query);
+		return 0;
+	}
+
+	// Sharing an earlier read would let it overtake the writes queued before it in its lane. A timeout of
+	// its own can't be honoured on a shared query either.
+	std::string key;
+	if (m_bCoalesceReads && options.lane.empty() && options.timeout < 0 && IsReadQuery(query))
+	{
+		key = GetQueryKey(query, usenumbers, options);
+
+		auto it = m_coalescingQueries.find(key);
+		if (it != m_coalescingQueries.end())
+		{
+			unsigned int id = ++m_iNextQueryID;
+			it->second->AddFollower(id, callback);
+			m_coalescedFollowers[id] = it->second;
+			m_iCoalesced++;
+			return id;
+		}
+	}
+
+	Query* newquery = new Query(query, callback, usenumbers);
+	newquery->SetID(++m_iNextQueryID);
+	newquery->SetTimeout(options.timeout < 0 ? m_dQueryTimeout : options.timeout);
+	newquery->SetDurable(options.durable);
+	newquery->SetSource(options.source);
+	newquery->SetFormat(options.format);
+	newquery->SetLane(options.lane);
+
+	if (!options.schema.empty())
+	{
+		SchemaPtr schema = FindSchema(options.schema);
+		if (!schema)
+		{
+			FailQuery(newquery, QUERY_ERROR_SCHEMA, ("Unknown schema " + options.schema).c_str());
+			return newquery->GetID();
+		}
+		newquery->SetSchema(schema);
+	}
+
+	if (!key.empty())
+	{
+		newquery->SetCoalesceKey(key);
+		m_coalescingQueries[key] = newquery;
+	}
+
+	if (options.cache && options.tables.empty())
+	{
+		FailQuery(newquery, QUERY_ERROR_REJECTED, "Cached queries need the tables they read");
+		return newquery->GetID();
+	}
+
+	if (options.cache && IsReadQuery(query))
+		newquery->SetCacheKey(key.empty() ? GetQueryKey(query, usenumbers, options) : key, options.tables, m_iCacheGeneration);
+
 	QueueQuery(newquery);
+	return newquery->GetID();
 }
 
-void Database::QueueQuery(Query* query)
+std::string Database::GetQueryKey(const char* query, bool usenumbers, const QueryOptions& options)
 {
-	io_service.post(std::bind(&Database::DoExecute, this, query));
+	std::string key(usenumbers ? "1" : "0");
+	key.push_back('0' + options.format);
+	key.append(options.schema);
+	key.push_back('\0');
+	key.append(query);
+	return key;
 }
 
-Query* Database::GetCompletedQueries()
+void Database::QueueCachedResult(const char* query, int callback, bool usenumbers, int ref)
 {
-	return m_completedQueries.pop_all();
+	Query* cached = new Query(query, callback, usenumbers);
+	cached->SetID(++m_iNextQueryID);
+	cached->SetCachedRef(ref);
+
+	// Delivered on the next dispatch like a result that came back instantly
+	m_completedQueries.push(cached);
+	completionWakeup.Notify();
 }
 
-void Database::PushCompleted(Query* query)
+void Database::InvalidateCache(const std::string& table, std::vector<int>& freed)
 {
-	m_completedQueries.push(query);
+	// Results of queries on it that are still running may predate the change
+	m_iCacheGeneration++;
+
+	if (table.empty())
+	{
+		m_iCacheCleared = m_iCacheGeneration;
+		m_queryCache.Clear(freed);
+		return;
+	}
+
+	m_tableGenerations[table] = m_iCacheGeneration;
+	m_queryCache.Invalidate(table, freed);
+
+	// Queries on our own database are usually tagged without it
+	size_t dot = table.find('.');
+	if (dot != std::string::npos && table.compare(0, dot, m_strDB) == 0)
+	{
+		m_tableGenerations[table.substr(dot + 1)] = m_iCacheGeneration;
+		m_queryCache.Invalidate(table.substr(dot + 1), freed);
+	}
 }
 
-void Database::DoExecute(Query* query)
+bool Database::IsCacheCurrent(const std::vector<std::string>& tables, unsigned int generation)
 {
-	MYSQL* pMYSQL = GetAvailableConnection();
+	if (m_iCacheCleared > generation)
+		return false;
 
-	const char* strquery = query->GetQuery().c_str();
-	size_t len = query->GetQueryLength();
+	for (auto iter = tables.begin(); iter != tables.end(); ++iter)
+	{
+		auto it = m_tableGenerations.find(*iter);
+		if (it != m_tableGenerations.end() && it->second > generation)
+			return false;
+	}
+
+	return true;
+}
 
-	mysql_real_query(pMYSQL, strquery, len);
+bool Database::EnableBinlogInvalidation(unsigned int serverid, std::string& error)
+{
+#ifndef BINLOG_SUPPORTED
+	error.assign("Following the binary log needs libmysql 5.7.9 or newer on this platform");
+	return false;
+#else
+	if (m_pBinlog)
+		return true;
 
-	int status;
-	do {
-		MYSQL_RES* pResult = mysql_store_result(pMYSQL);
-		unsigned int errorno = mysql_errno(pMYSQL);
+	if (m_bShuttingDown)
+	{
+		error.assign("Database is shutting down");
+		return false;
+	}
 
-		Result* result = new Result();
+	m_pBinlog = new BinlogListener(serverid, [this](std::string& connecterror) -> MYSQL*
+	{
+		// The server sends heartbeats while the log is quiet, a read that outlasts them means the connection is gone.
+		// It also bounds how long Stop waits for the listener.
+		MYSQL* mysql = mysql_init(NULL);
+		unsigned int timeout = BINLOG_READ_TIMEOUT;
+		mysql_options(mysql, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+		mysql_options(mysql, MYSQL_OPT_READ_TIMEOUT, &timeout);
+		if (!Connect(mysql, connecterror, 0, false))
 		{
-			result->SetResult(pResult);
-			result->SetErrorID(errorno);
-			result->SetError(mysql_error(pMYSQL));
-			result->SetAffected((double)mysql_affected_rows(pMYSQL));
-			result->SetLastID((double)mysql_insert_id(pMYSQL));
+			mysql_close(mysql);
+			return NULL;
 		}
-		query->AddResult(result);
-		status = mysql_next_result(pMYSQL);
-	} while (status != -1);
+		return mysql;
+	},
+	std::bind(&Database::OnTableChanged, this, std::placeholders::_1, std::placeholders::_2),
+	[this](int errorid, const std::string& error)
+	{
+		ReportError("BINLOG DUMP", errorid, error.c_str());
+	});
 
-	PushCompleted(query);
-	ReturnConnection(pMYSQL);
+	m_pBinlog->Start();
+	return true;
+#endif
+}
+
+// Called on the binlog thread
+void Database::OnTableChanged(const std::string& db, const std::string& table)
+{
+	{
+		std::lock_guard<std::mutex> guard(m_InvalidationMutex);
+
+		if (table.empty())
+			m_invalidations.insert("");
+		else
+			m_invalidations.insert(db + "." + table);
+	}
+
+	completionWakeup.Notify();
+}
+
+bool Database::PopInvalidations(std::vector<std::string>& tables)
+{
+	std::lock_guard<std::mutex> guard(m_InvalidationMutex);
+
+	if (m_invalidations.empty())
+		return false;
+
+	// Everything goes anyway, the rest would only be wasted lookups
+	if (m_invalidations.count(""))
+		tables.push_back("");
+	else
+		tables.assign(m_invalidations.begin(), m_invalidations.end());
+
+	m_invalidations.clear();
+	return true;
+}
+
+SchemaPtr Database::FindSchema(const std::string& name)
+{
+	auto it = m_schemas.find(name);
+	if (it == m_schemas.end())
+		return SchemaPtr();
+
+	return it->second;
+}
+
+unsigned int Database::QueueExport(const char* query, const char* path, QueryFormat format, int callback, const QueryOptions& options)
+{
+	Query* newquery = new Query(query, callback);
+	newquery->SetID(++m_iNextQueryID);
+	newquery->SetTimeout(options.timeout < 0 ? m_dQueryTimeout : options.timeout);
+	newquery->SetDurable(options.durable);
+	newquery->SetSource(options.source);
+	newquery->SetFormat(format);
+	newquery->SetLane(options.lane);
+	newquery->SetExportPath(path);
+
+	QueueQuery(newquery);
+	return newquery->GetID();
+}
+
+std::string Database::QuoteIdentifier(const std::string& name)
+{
+	std::string quoted("`");
+	for (size_t i = 0; i < name.length(); i++)
+	{
+		if (name[i] == '.')
+			quoted.append("`.`");
+		else if (name[i] == '`')
+			quoted.append("``");
+		else
+			quoted.push_back(name[i]);
+	}
+	quoted.push_back('`');
+	return quoted;
+}
+
+unsigned int Database::QueueBlobWrite(const char* table, const std::vector<std::pair<std::string, std::string> >& keys, const char* column, const char* path, int callback, const QueryOptions& options)
+{
+	std::string query("INSERT INTO " + QuoteIdentifier(table) + " (");
+	std::string values;
+	std::vector<std::string> parameters;
+
+	for (auto iter = keys.begin(); iter != keys.end(); ++iter)
+	{
+		query.append(QuoteIdentifier(iter->first));
+		query.append(", ");
+		values.append("?, ");
+		parameters.push_back(iter->second);
+	}
+
+	query.append(QuoteIdentifier(column));
+	query.append(") VALUES (" + values + "?) ON DUPLICATE KEY UPDATE ");
+	query.append(QuoteIdentifier(column) + " = VALUES(" + QuoteIdentifier(column) + ")");
+
+	Query* newquery = new Query(query.c_str(), callback);
+	newquery->SetID(++m_iNextQueryID);
+	newquery->SetTimeout(options.timeout < 0 ? m_dQueryTimeout : options.timeout);
+	newquery->SetDurable(options.durable);
+	newquery->SetSource(options.source);
+	newquery->SetLane(options.lane);
+	newquery->SetImport(parameters, path);
+
+	QueueQuery(newquery);
+	return newquery->GetID();
+}
+
+bool Database::QueueScanPage(const std::shared_ptr<TableScan>& scan)
+{
+	if (m_bShuttingDown)
+		return false;
+
+	QueueQuery(NewScanPage(scan));
+	return true;
+}
+
+// Main thread or worker. Every page gets the options db:Scan was called with
+Query* Database::NewScanPage(const std::shared_ptr<TableScan>& scan)
+{
+	const QueryOptions& options = scan->GetOptions();
+
+	Query* page = new Query(scan->BuildQuery().c_str());
+	page->SetID(++m_iNextQueryID);
+	page->SetTimeout(options.timeout < 0 ? m_dQueryTimeout : options.timeout);
+	page->SetDurable(options.durable);
+	page->SetSource(options.source);
+	page->SetScan(scan);
+	return page;
+}
+
+void Database::SetWriteBehind(bool enabled, unsigned int maxstatements, size_t maxbytes, double interval)
+{
+	{
+		std::lock_guard<std::mutex> guard(m_WriteMutex);
+		m_bWriteBehind = enabled;
+		m_iWriteMaxStatements = maxstatements > 0 ? maxstatements : 1;
+		m_iWriteMaxBytes = maxbytes;
+		m_dWriteInterval = interval;
+	}
+
+	// Turning it off shouldn't strand what was buffered
+	if (!enabled)
+		ScheduleWriteFlush(true);
+}
+
+size_t Database::GetWriteBehindCount(void)
+{
+	std::lock_guard<std::mutex> guard(m_WriteMutex);
+	return m_writeBuffer.size();
+}
+
+// Only the first statement of query, without its trailing semicolons and whitespace. Sets more when
+// something other than comments and whitespace follows it.
+static std::string FirstStatement(const char* query, bool& more)
+{
+	const char* end = query;
+	char quote = 0;
+	more = false;
+
+	for (const char* c = query; *c; c++)
+	{
+		if (quote)
+		{
+			if (*c == '\\' && c[1])
+				c++;
+			else if (*c == quote)
+				quote = 0;
+			continue;
+		}
+
+		if (*c == '\'' || *c == '"' || *c == '`')
+			quote = *c;
+		else if (*c == '#' || (*c == '-' && c[1] == '-' && (c[2] == ' ' || c[2] == '\t' || c[2] == '\n' || c[2] == '\0')))
+		{
+			while (c[1] && c[1] != '\n')
+				c++;
+			continue;
+		}
+		else if (*c == '/' && c[1] == '*')
+		{
+			const char* close = strstr(c + 2, "*/");
+			if (close == NULL)
+				break;
+			c = close + 1;
+			continue;
+		}
+		else if (*c == ';')
+		{
+			// Anything but more semicolons, whitespace or comments is another statement
+			bool dummy;
+			for (const char* rest = c + 1; *rest; rest++)
+			{
+				if (!isspace((unsigned char)*rest) && *rest != ';')
+				{
+					more = !FirstStatement(rest, dummy).empty();
+					break;
+				}
+			}
+			break;
+		}
+
+		if (!isspace((unsigned char)*c))
+			end = c + 1;
+	}
+
+	while (isspace((unsigned char)*query) && query < end)
+		query++;
+
+	return std::string(query, end - query);
+}
+
+void Database::QueueWrite(const char* query)
+{
+	// Batches join statements with ";\n" and map failures back by statement index, which only works for one each
+	bool more;
+	std::string statement(FirstStatement(query, more));
+	if (more || statement.empty())
+	{
+		ReportError(query, QUERY_ERROR_REJECTED, more ? "Write-behind takes a single statement" : "Query was empty");
+		return;
+	}
+
+	// The buffer only grows while the server is unreachable. It's held to the queue limits like the pending
+	// queue, except that blocking the game for the length of an outage isn't an option: BLOCK drops the oldest too.
+	unsigned int maxstatements;
+	size_t maxbytes;
+	BackpressurePolicy policy;
+	{
+		std::lock_guard<std::mutex> guard(m_PendingMutex);
+		maxstatements = m_iMaxQueries;
+		maxbytes = m_iMaxQueuedBytes > 0 && m_iMaxQueuedBytes < WRITE_BUFFER_MAX_BYTES ? m_iMaxQueuedBytes : WRITE_BUFFER_MAX_BYTES;
+		policy = m_iBackpressurePolicy;
+	}
+
+	bool first, full, backoff, rejected = false;
+	std::vector<std::string> dropped;
+	{
+		std::lock_guard<std::mutex> guard(m_WriteMutex);
+
+		auto over = [&]()
+		{
+			return (maxstatements > 0 && m_writeBuffer.size() + 1 > maxstatements) ||
+				m_iWriteBufferBytes + statement.length() > maxbytes;
+		};
+
+		if (policy == BACKPRESSURE_REJECT)
+			rejected = over();
+		else
+		{
+			while (!m_writeBuffer.empty() && over())
+			{
+				m_iWriteBufferBytes -= m_writeBuffer.front().length();
+				dropped.push_back(std::string());
+				dropped.back().swap(m_writeBuffer.front());
+				m_writeBuffer.pop_front();
+			}
+		}
+
+		first = m_writeBuffer.empty();
+		backoff = m_dWriteBackoff > 0;
+
+		if (!rejected)
+		{
+			m_iWriteBufferBytes += statement.length();
+			m_writeBuffer.push_back(std::string());
+			m_writeBuffer.back().swap(statement);
+		}
+
+		full = m_writeBuffer.size() >= m_iWriteMaxStatements || (m_iWriteMaxBytes > 0 && m_iWriteBufferBytes >= m_iWriteMaxBytes);
+	}
+
+	for (auto iter = dropped.begin(); iter != dropped.end(); ++iter)
+	{
+		m_iDropped++;
+		ReportError(iter->c_str(), QUERY_ERROR_DROPPED, "Write dropped, write-behind buffer is full");
+	}
+
+	if (rejected)
+	{
+		m_iRejected++;
+		ReportError(query, QUERY_ERROR_REJECTED, "Write rejected, write-behind buffer is full");
+		return;
+	}
+
+	if (full)
+		ScheduleWriteFlush();
+	else if (first && !backoff)
+		Post(sharedExecutor.GetTimerService(), std::bind(&Database::ArmWriteTimer, this, m_dWriteInterval));
+}
+
+// Timer thread only
+void Database::ArmWriteTimer(double seconds)
+{
+	if (!m_writeTimer)
+		m_writeTimer = std::make_shared<asio::steady_timer>(sharedExecutor.GetTimerService());
+
+	m_writeTimer->expires_from_now(std::chrono::milliseconds((long long)(seconds * 1000)));
+
+	BeginTask();
+	m_writeTimer->async_wait([this](const system::error_code& ec)
+	{
+		if (!ec)
+			ScheduleWriteFlush(true);
+		EndTask();
+	});
+}
+
+// Unforced flushes wait for the backoff timer while the server is unreachable
+void Database::ScheduleWriteFlush(bool force)
+{
+	{
+		std::lock_guard<std::mutex> guard(m_WriteMutex);
+
+		if (m_bFlushingWrites || m_writeBuffer.empty() || (!force && m_dWriteBackoff > 0))
+			return;
+
+		m_bFlushingWrites = true;
+	}
+
+	Post(sharedExecutor.GetWorkService(), std::bind(&Database::FlushWrites, this));
+}
+
+static bool IsConnectionError(unsigned int errorid)
+{
+	return errorid == CR_SERVER_GONE_ERROR || errorid == CR_SERVER_LOST || errorid == CR_CONN_HOST_ERROR || errorid == CR_CONNECTION_ERROR;
+}
+
+// Worker thread, one flush at a time on the write connection
+void Database::FlushWrites(void)
+{
+	unsigned int connecterror = 0;
+	std::string connectmessage;
+
+	if (m_pWriteConnection == NULL)
+	{
+		MYSQL* mysql = mysql_init(NULL);
+
+		if (Connect(mysql, connectmessage, CLIENT_MULTI_STATEMENTS))
+			m_pWriteConnection = mysql;
+		else
+		{
+			connecterror = mysql_errno(mysql) != 0 ? mysql_errno(mysql) : CR_CONN_HOST_ERROR;
+			mysql_close(mysql);
+		}
+	}
+
+	bool unreachable = false;
+
+	while (true)
+	{
+		std::vector<std::string> batch;
+		std::string sql;
+		{
+			std::lock_guard<std::mutex> guard(m_WriteMutex);
+
+			while (!m_writeBuffer.empty() && batch.size() < m_iWriteMaxStatements &&
+				(batch.empty() || m_iWriteMaxBytes == 0 || sql.length() + m_writeBuffer.front().length() < m_iWriteMaxBytes))
+			{
+				if (!sql.empty())
+					sql.append(";\n");
+				sql.append(m_writeBuffer.front());
+
+				m_iWriteBufferBytes -= m_writeBuffer.front().length();
+				batch.push_back(std::string());
+				batch.back().swap(m_writeBuffer.front());
+				m_writeBuffer.pop_front();
+			}
+		}
+
+		if (batch.empty())
+			break;
+
+		// A failing statement ends the batch, report it and put the ones after it back
+		size_t failed = batch.size();
+		unsigned int errorid = connecterror;
+		std::string error(connectmessage);
+
+		if (m_pWriteConnection == NULL)
+			failed = 0;
+		else if (mysql_real_query(m_pWriteConnection, sql.c_str(), sql.length()) != 0)
+			failed = 0;
+		else
+		{
+			for (size_t index = 0;; )
+			{
+				MYSQL_RES* result = mysql_store_result(m_pWriteConnection);
+				if (result)
+					mysql_free_result(result);
+
+				int status = mysql_next_result(m_pWriteConnection);
+				if (status == -1)
+					break;
+
+				index++;
+				if (status > 0)
+				{
+					failed = index < batch.size() ? index : batch.size() - 1;
+					break;
+				}
+			}
+		}
+
+		if (failed < batch.size() && m_pWriteConnection != NULL)
+		{
+			errorid = mysql_errno(m_pWriteConnection);
+			error.assign(mysql_error(m_pWriteConnection));
+		}
+
+		if (m_pWriteConnection != NULL)
+			m_iWriteBatches++;
+
+		m_iWritesFlushed += (unsigned int)failed;
+
+		if (failed == batch.size())
+			continue;
+
+		// Nothing is wrong with the statement, keep it and everything after it until the server is back.
+		// Shutting down can't wait for that, those are reported like any other failure.
+		bool keep = IsConnectionError(errorid) && !m_bShuttingDown;
+		if (keep)
+			unreachable = true;
+		else
+			ReportError(batch[failed], errorid, error.c_str());
+
+		std::lock_guard<std::mutex> guard(m_WriteMutex);
+		for (size_t i = batch.size() - 1; i > failed || (keep && i == failed); i--)
+		{
+			m_iWriteBufferBytes += batch[i].length();
+			m_writeBuffer.push_front(std::string());
+			m_writeBuffer.front().swap(batch[i]);
+
+			if (i == 0)
+				break;
+		}
+
+		if (keep)
+			break;
+	}
+
+	// Reconnect from scratch once the backoff runs out
+	if (unreachable && m_pWriteConnection != NULL)
+	{
+		mysql_close(m_pWriteConnection);
+		m_pWriteConnection = NULL;
+	}
+
+	bool rearm;
+	double backoff;
+	{
+		std::lock_guard<std::mutex> guard(m_WriteMutex);
+		m_bFlushingWrites = false;
+
+		// Doubles from the flush interval up to a minute, every success starts over
+		if (unreachable)
+			m_dWriteBackoff = m_dWriteBackoff > 0 ? std::min(m_dWriteBackoff * 2, 60.0) : std::max(m_dWriteInterval, 0.5);
+		else
+			m_dWriteBackoff = 0;
+
+		backoff = m_dWriteBackoff;
+		rearm = !m_writeBuffer.empty();
+	}
+	m_WriteCV.notify_all();
+
+	if (unreachable)
+		Post(sharedExecutor.GetTimerService(), std::bind(&Database::ArmWriteTimer, this, backoff));
+	// Raced with QueueWrite after the last batch was taken
+	else if (rearm)
+		ScheduleWriteFlush();
+}
+
+// Hands an error without a Query of its own to the main thread's error handler
+void Database::ReportError(const std::string& query, int errorid, const char* error)
+{
+	Query* failed = new Query(query.c_str());
+	FailQuery(failed, errorid, error);
+}
+
+void Database::UpsertCoalesced(const char* key, const char* query)
+{
+	auto it = m_upserts.find(key);
+	if (it != m_upserts.end())
+	{
+		it->second.assign(query);
+		m_iUpsertsSaved++;
+		return;
+	}
+
+	if (m_upserts.empty())
+	{
+		m_upsertDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds((long long)(m_dUpsertInterval * 1000));
+		completionWakeup.SetDeadline(m_upsertDeadline);
+	}
+
+	m_upserts[key].assign(query);
+	m_upsertOrder.push_back(key);
+}
+
+void Database::FlushCoalesced(bool force)
+{
+	if (m_upserts.empty())
+		return;
+
+	if (!force && std::chrono::steady_clock::now() < m_upsertDeadline)
+	{
+		completionWakeup.SetDeadline(m_upsertDeadline);
+		return;
+	}
+
+	std::vector<std::string> order;
+	order.swap(m_upsertOrder);
+
+	std::unordered_map<std::string, std::string> upserts;
+	upserts.swap(m_upserts);
+
+	// These already stood in for several writes, a shutdown deadline shouldn't throw them away
+	QueryOptions options;
+	options.durable = true;
+
+	for (auto iter = order.begin(); iter != order.end(); ++iter)
+		QueueQuery(upserts[*iter].c_str(), -1, false, options);
+}
+
+void Database::SetQueueLimits(unsigned int maxqueries, size_t maxbytes, BackpressurePolicy policy)
+{
+	std::lock_guard<std::mutex> guard(m_PendingMutex);
+	m_iMaxQueries = maxqueries;
+	m_iMaxQueuedBytes = maxbytes;
+	m_iBackpressurePolicy = policy;
+}
+
+bool Database::IsOverQueueLimits(size_t querylength)
+{
+	return (m_iMaxQueries > 0 && m_iInFlight + 1 > m_iMaxQueries) ||
+		(m_iMaxQueuedBytes > 0 && m_iQueuedBytes + querylength > m_iMaxQueuedBytes);
+}
+
+void Database::QueueQuery(Query* query)
+{
+	{
+		std::lock_guard<std::mutex> guard(m_ActiveMutex);
+		m_activeQueries[query->GetID()] = query;
+	}
+
+	std::vector<Query*> dropped;
+	{
+		std::unique_lock<std::mutex> lock(m_PendingMutex);
+
+		if (m_bConnectFailed)
+		{
+			lock.unlock();
+			FailQuery(query, CR_CONN_HOST_ERROR, "Database failed to connect");
+			return;
+		}
+
+		if (IsOverQueueLimits(query->GetQueryLength()))
+		{
+			switch (m_iBackpressurePolicy)
+			{
+			case BACKPRESSURE_REJECT:
+				lock.unlock();
+				m_iRejected++;
+				FailQuery(query, QUERY_ERROR_REJECTED, "Query rejected, queue is full");
+				return;
+
+			case BACKPRESSURE_DROP_OLDEST:
+				while (IsOverQueueLimits(query->GetQueryLength()))
+				{
+					Query* oldest = TakeOldestPending();
+					if (oldest == NULL)
+						break;
+					dropped.push_back(oldest);
+				}
+
+				// Everything left is running already, the new query is the one that can't fit
+				if (IsOverQueueLimits(query->GetQueryLength()))
+				{
+					lock.unlock();
+					for (auto iter = dropped.begin(); iter != dropped.end(); ++iter)
+					{
+						m_iDropped++;
+						FailQuery(*iter, QUERY_ERROR_DROPPED, "Query dropped, queue is full");
+					}
+
+					m_iRejected++;
+					FailQuery(query, QUERY_ERROR_REJECTED, "Query rejected, queue is full");
+
+					std::lock_guard<std::mutex> guard(m_PendingMutex);
+					Schedule();
+					return;
+				}
+				break;
+
+			case BACKPRESSURE_BLOCK:
+				m_PendingCV.wait(lock, [&]() { return !IsOverQueueLimits(query->GetQueryLength()) || m_iInFlight == 0; });
+				break;
+			}
+		}
+
+		PushPending(query);
+		m_iQueuedBytes += query->GetQueryLength();
+		m_iInFlight++;
+	}
+
+	for (auto iter = dropped.begin(); iter != dropped.end(); ++iter)
+	{
+		m_iDropped++;
+		FailQuery(*iter, QUERY_ERROR_DROPPED, "Query dropped, queue is full");
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(m_PendingMutex);
+		Schedule();
+	}
+}
+
+// Caller holds m_PendingMutex
+void Database::Schedule(void)
+{
+	while (m_iRunning < m_iPoolSize && m_iRunning < m_pendingQueries.size())
+	{
+		m_iRunning++;
+		Post(sharedExecutor.GetWorkService(), std::bind(&Database::RunNext, this));
+	}
+}
+
+// Caller holds m_PendingMutex. Queries behind a busy lane wait there instead of in the pending queue
+void Database::PushPending(Query* query)
+{
+	const std::string& lane = query->GetLane();
+	if (!lane.empty())
+	{
+		auto it = m_lanes.find(lane);
+		if (it != m_lanes.end())
+		{
+			it->second.push_back(query);
+			return;
+		}
+
+		m_lanes[lane];
+	}
+
+	m_pendingQueries.push_back(query);
+}
+
+// Caller holds m_PendingMutex. Takes every query that hasn't started, including those waiting in lanes
+void Database::TakePending(std::vector<Query*>& taken)
+{
+	std::vector<Query*> waiting;
+	for (auto lane = m_lanes.begin(); lane != m_lanes.end(); ++lane)
+	{
+		waiting.insert(waiting.end(), lane->second.begin(), lane->second.end());
+		lane->second.clear();
+	}
+
+	// Lanes stay busy only while their head is running
+	for (auto iter = m_pendingQueries.begin(); iter != m_pendingQueries.end(); ++iter)
+		ReleaseLane(*iter);
+
+	m_iInFlight -= (unsigned int)(m_pendingQueries.size() + waiting.size());
+	m_iQueuedBytes = 0;
+
+	taken.insert(taken.end(), m_pendingQueries.begin(), m_pendingQueries.end());
+	taken.insert(taken.end(), waiting.begin(), waiting.end());
+	m_pendingQueries.clear();
+}
+
+// Caller holds m_PendingMutex. Takes the longest queued query that hasn't started, whether it's pending or
+// waiting in a lane. NULL when there is none
+Query* Database::TakeOldestPending(void)
+{
+	// IDs are handed out in queueing order
+	std::deque<Query*>* from = NULL;
+	std::deque<Query*>::iterator oldest;
+
+	for (auto iter = m_pendingQueries.begin(); iter != m_pendingQueries.end(); ++iter)
+	{
+		if (from == NULL || (*iter)->GetID() < (*oldest)->GetID())
+		{
+			from = &m_pendingQueries;
+			oldest = iter;
+		}
+	}
+
+	// Each lane is in order, only its first waiter can be older
+	for (auto lane = m_lanes.begin(); lane != m_lanes.end(); ++lane)
+	{
+		std::deque<Query*>& waiting = lane->second;
+		if (!waiting.empty() && (from == NULL || waiting.front()->GetID() < (*oldest)->GetID()))
+		{
+			from = &waiting;
+			oldest = waiting.begin();
+		}
+	}
+
+	if (from == NULL)
+		return NULL;
+
+	Query* query = *oldest;
+	from->erase(oldest);
+
+	m_iQueuedBytes -= query->GetQueryLength();
+	m_iInFlight--;
+
+	// A pending query may be the head of its lane, the next one takes its place
+	if (from == &m_pendingQueries)
+		ReleaseLane(query);
+
+	return query;
+}
+
+// Caller holds m_PendingMutex. The lane's head finished or was dropped, the next of the lane becomes pending
+void Database::ReleaseLane(Query* query)
+{
+	const std::string& lane = query->GetLane();
+	if (lane.empty())
+		return;
+
+	auto it = m_lanes.find(lane);
+	if (it == m_lanes.end())
+		return;
+
+	if (it->second.empty())
+	{
+		m_lanes.erase(it);
+		return;
+	}
+
+	m_pendingQueries.push_back(it->second.front());
+	it->second.pop_front();
+}
+
+// Completes a query that never reached a connection
+void Database::FailQuery(Query* query, int errorid, const char* error)
+{
+	Result* result = new Result();
+	{
+		result->SetResult(NULL);
+		result->SetErrorID(errorid);
+		result->SetError(error);
+	}
+	query->AddResult(result);
+
+	if (query->GetScan())
+		query->GetScan()->PageCompleted(NULL, result, false);
+
+	PushCompleted(query);
+}
+
+// Hands a caller of a shared query the same cancelled result a query of its own would have given
+void Database::DetachCancelled(Query* shared, int callback)
+{
+	Query* detached = new Query(shared->GetQuery().c_str(), callback, shared->GetUseNumbers());
+	detached->SetFormat(shared->GetFormat());
+
+	FailQuery(detached, QUERY_ERROR_CANCELLED, "Query cancelled");
+}
+
+// A follow-up queued by a worker while its query is still in flight. Skips the queue limits, BLOCK
+// would have the worker wait on itself, and goes first so it runs right after the current one.
+void Database::QueueContinuation(Query* query)
+{
+	{
+		std::lock_guard<std::mutex> guard(m_ActiveMutex);
+		m_activeQueries[query->GetID()] = query;
+	}
+
+	std::lock_guard<std::mutex> guard(m_PendingMutex);
+	m_pendingQueries.push_front(query);
+	m_iQueuedBytes += query->GetQueryLength();
+	m_iInFlight++;
+	Schedule();
+}
+
+void Database::RunNext(void)
+{
+	Query* query = NULL;
+	{
+		std::lock_guard<std::mutex> guard(m_PendingMutex);
+
+		// Entries may have been dropped after this was posted
+		if (!m_pendingQueries.empty())
+		{
+			query = m_pendingQueries.front();
+			m_pendingQueries.pop_front();
+			m_iQueuedBytes -= query->GetQueryLength();
+		}
+	}
+
+	if (query)
+		DoExecute(query);
+
+	{
+		std::lock_guard<std::mutex> guard(m_PendingMutex);
+
+		if (query)
+		{
+			m_iInFlight--;
+			ReleaseLane(query);
+		}
+
+		m_iRunning--;
+		Schedule();
+	}
+	m_PendingCV.notify_all();
+}
+
+// Main thread. Coalesced callers only give up their share, the query goes on for the others.
+bool Database::CancelQuery(unsigned int id)
+{
+	auto follower = m_coalescedFollowers.find(id);
+	if (follower != m_coalescedFollowers.end())
+	{
+		int callback;
+		if (follower->second->RemoveFollower(id, callback))
+			DetachCancelled(follower->second, callback);
+
+		m_coalescedFollowers.erase(follower);
+		return true;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(m_ActiveMutex);
+		auto it = m_activeQueries.find(id);
+		if (it == m_activeQueries.end())
+			return false;
+
+		Query* query = it->second;
+		if (!query->GetFollowers().empty())
+		{
+			if (query->GetCallback() >= 0)
+			{
+				DetachCancelled(query, query->GetCallback());
+				query->SetCallback(-1);
+			}
+			return true;
+		}
+
+		query->SetCancelled();
+
+		// Not started yet, DoExecute will skip it
+		if (query->GetThreadID() == 0)
+			return true;
+	}
+
+	Post(sharedExecutor.GetKillService(), std::bind(&Database::KillQuery, this, id, false));
+	return true;
+}
+
+// Kill thread only. Its own short timeouts, a server too busy to take a KILL mustn't hold up the next one forever.
+void Database::ConnectKill(void)
+{
+	if (m_pKillConnection != NULL)
+		return;
+
+	std::string error;
+	MYSQL* mysql = mysql_init(NULL);
+
+	unsigned int timeout = KILL_TIMEOUT;
+	mysql_options(mysql, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+	mysql_options(mysql, MYSQL_OPT_READ_TIMEOUT, &timeout);
+	mysql_options(mysql, MYSQL_OPT_WRITE_TIMEOUT, &timeout);
+
+	if (!Connect(mysql, error, 0, false))
+	{
+		mysql_close(mysql);
+		return;
+	}
+
+	// Reconnecting is left to the next kill, not done behind mysql_query's back
+	my_bool reconnect = 0;
+	mysql_options(mysql, MYSQL_OPT_RECONNECT, &reconnect);
+
+	m_pKillConnection = mysql;
+}
+
+// Kill thread only
+void Database::KillQuery(unsigned int id, bool timedout)
+{
+	Query* query;
+	unsigned long threadid;
+	{
+		std::lock_guard<std::mutex> guard(m_ActiveMutex);
+
+		auto it = m_activeQueries.find(id);
+		if (it == m_activeQueries.end() || it->second->GetThreadID() == 0)
+			return;
+
+		query = it->second;
+		if (timedout)
+			query->SetTimedOut();
+
+		// Keeps DoExecute from letting go of the connection, and the query, until the KILL is through.
+		// Otherwise it could land on whatever the connection runs next.
+		threadid = query->GetThreadID();
+		query->BeginKill();
+	}
+
+	char kill[32];
+	snprintf(kill, sizeof(kill), "KILL QUERY %lu", threadid);
+
+	// A stale side connection gets one fresh attempt
+	for (int attempt = 0; attempt < 2; attempt++)
+	{
+		ConnectKill();
+		if (m_pKillConnection == NULL || mysql_query(m_pKillConnection, kill) == 0)
+			break;
+
+		mysql_close(m_pKillConnection);
+		m_pKillConnection = NULL;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(m_ActiveMutex);
+		query->EndKill();
+	}
+	m_KillCV.notify_all();
+}
+
+Query* Database::GetCompletedQueries()
+{
+	Query* completed = m_completedQueries.pop_all();
+
+	// Later submissions of these have to run again
+	for (Query* query = completed; query; query = query->next)
+	{
+		if (!query->GetCoalesceKey().empty())
+			m_coalescingQueries.erase(query->GetCoalesceKey());
+
+		const Followers& followers = query->GetFollowers();
+		for (auto iter = followers.begin(); iter != followers.end(); ++iter)
+			m_coalescedFollowers.erase(iter->id);
+	}
+
+	if (m_pDeferredCompleted)
+	{
+		Query* last = m_pDeferredCompleted;
+		while (last->next)
+			last = last->next;
+
+		last->next = completed;
+		completed = m_pDeferredCompleted;
+		m_pDeferredCompleted = NULL;
+	}
+
+	return completed;
+}
+
+void Database::PushCompleted(Query* query)
+{
+	// Encoded or decoded on the completing thread, the MYSQL_RES isn't needed after that
+	Results results = query->GetResults();
+	if (query->GetFormat() == FORMAT_JSON)
+	{
+		std::string encoded;
+		AppendJSONResults(encoded, query);
+		query->SetEncoded(encoded);
+
+		for (auto iter = results.begin(); iter != results.end(); ++iter)
+			(*iter)->FreeResult();
+	}
+	else
+	{
+		for (auto iter = results.begin(); iter != results.end(); ++iter)
+			(*iter)->Decode();
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(m_ActiveMutex);
+		m_activeQueries.erase(query->GetID());
+	}
+
+	m_completedQueries.push(query);
+	completionWakeup.Notify();
+}
+
+void Database::SetSlowQueryLog(double threshold, const char* path)
+{
+	std::lock_guard<std::mutex> guard(m_SlowLogMutex);
+	m_dSlowQueryThreshold = threshold;
+	m_strSlowLogPath.assign(path ? path : "");
+}
+
+static void AppendSlowQueryLog(const std::string& path, const std::string& database, const SlowQueryEntry& entry)
+{
+	FILE* file = fopen(path.c_str(), "a");
+	if (!file)
+		return;
+
+	char when[32];
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&entry.when));
+
+	fprintf(file, "%s %s queue=%.3f exec=%.3f fetch=%.3f rows=%.0f bytes=%.0f error=%d source=%s",
+		when, database.c_str(), entry.queuetime, entry.exectime, entry.fetchtime,
+		entry.rows, entry.bytes, entry.errorid, entry.source);
+
+	if (entry.explained)
+	{
+		fprintf(file, " access=%s key=%s examined=%.0f%s%s%s", entry.access, entry.key[0] ? entry.key : "-", entry.examined,
+			entry.filesort ? " filesort" : "", entry.temporary ? " temporary" : "", entry.fullscan ? " FULLSCAN" : "");
+	}
+
+	fprintf(file, " query=%s\n", entry.query);
+	fclose(file);
+}
+
+// Value of the next "name": at or after pos, quotes stripped. Leaves pos just past the value
+static bool FindJSONField(const std::string& json, const char* name, size_t& pos, std::string& value)
+{
+	std::string needle("\"");
+	needle.append(name);
+	needle.append("\":");
+
+	pos = json.find(needle, pos);
+	if (pos == std::string::npos)
+		return false;
+
+	pos += needle.length();
+	while (pos < json.length() && json[pos] == ' ')
+		pos++;
+
+	size_t end;
+	if (pos < json.length() && json[pos] == '"')
+	{
+		end = json.find('"', ++pos);
+		if (end == std::string::npos)
+			end = json.length();
+	}
+	else
+		end = json.find_first_of(",}\n ", pos);
+
+	value.assign(json, pos, end == std::string::npos ? std::string::npos : end - pos);
+	pos = end;
+	return true;
+}
+
+// Ranked from best to worst as MySQL documents the join types
+static int AccessTypeRank(const std::string& type)
+{
+	static const char* ranks[] = { "system", "const", "eq_ref", "ref", "fulltext", "ref_or_null", "index_merge",
+		"unique_subquery", "index_subquery", "range", "index", "ALL" };
+
+	for (size_t i = 0; i < sizeof(ranks) / sizeof(ranks[0]); i++)
+	{
+		if (type == ranks[i])
+			return (int)i;
+	}
+	return -1;
+}
+
+// Folds every table of the plan into one line, enough to spot missing indexes
+static void SummarizeExplain(const std::string& json, SlowQueryEntry& entry)
+{
+	std::string value;
+	std::string access;
+
+	for (size_t pos = 0; pos != std::string::npos && FindJSONField(json, "access_type", pos, value);)
+	{
+		if (AccessTypeRank(value) > AccessTypeRank(access))
+			access = value;
+	}
+
+	for (size_t pos = 0; pos != std::string::npos && FindJSONField(json, "rows_examined_per_scan", pos, value);)
+		entry.examined = std::max(entry.examined, atof(value.c_str()));
+
+	size_t pos = 0;
+	if (FindJSONField(json, "key", pos, value))
+		snprintf(entry.key, sizeof(entry.key), "%s", value.c_str());
+
+	pos = 0;
+	entry.filesort = FindJSONField(json, "using_filesort", pos, value) && value == "true";
+	pos = 0;
+	entry.temporary = FindJSONField(json, "using_temporary_table", pos, value) && value == "true";
+
+	snprintf(entry.access, sizeof(entry.access), "%s", access.c_str());
+	entry.fullscan = access == "ALL";
+	entry.explained = true;
+}
+
+// Rows, bytes and last error over every result set, rewinds them so the main thread still sees every row
+static void MeasureResults(Query* query, double& rows, double& bytes, int& errorid)
+{
+	rows = 0;
+	bytes = 0;
+	errorid = 0;
+
+	Results results = query->GetResults();
+	for (auto iter = results.begin(); iter != results.end(); ++iter)
+	{
+		Result* result = *iter;
+		if (result->GetErrorID() != 0)
+			errorid = result->GetErrorID();
+
+		if (result->IsExported())
+		{
+			rows += result->GetExportedRows();
+			bytes += result->GetExportedBytes();
+		}
+
+		MYSQL_RES* res = result->GetResult();
+		if (res == NULL)
+			continue;
+
+		rows += (double)mysql_num_rows(res);
+
+		unsigned int fields = mysql_num_fields(res);
+		while (mysql_fetch_row(res))
+		{
+			unsigned long* lengths = mysql_fetch_lengths(res);
+			for (unsigned int i = 0; i < fields; i++)
+				bytes += lengths[i];
+		}
+		mysql_data_seek(res, 0);
+	}
+}
+
+// Rows are fetched one at a time and go straight into a buffered file, nothing of them is kept.
+// Written next to path and renamed over it once complete, readers never see a partial export.
+void Database::ExportResults(MYSQL* mysql, Query* query)
+{
+	Result* result = new Result();
+	query->AddResult(result);
+
+	if (mysql_errno(mysql) != 0)
+	{
+		result->SetErrorID(mysql_errno(mysql));
+		result->SetError(mysql_error(mysql));
+		return;
+	}
+
+	std::string temp(query->GetExportPath() + ".tmp");
+	FILE* file = fopen(temp.c_str(), "wb");
+	if (file)
+		setvbuf(file, NULL, _IOFBF, 1 << 16);
+
+	MYSQL_RES* res = mysql_use_result(mysql);
+
+	double rows = 0;
+	double bytes = 0;
+	bool failed = file == NULL;
+
+	if (res != NULL && file != NULL)
+	{
+		unsigned int count = mysql_num_fields(res);
+		MYSQL_FIELD* fields = mysql_fetch_fields(res);
+
+		// The header goes out even when no row follows it
+		std::string line;
+		if (query->GetFormat() == FORMAT_CSV)
+		{
+			AppendCSVHeader(line, fields, count);
+
+			failed = fwrite(line.data(), 1, line.length(), file) != line.length();
+			bytes += line.length();
+			line.clear();
+		}
+
+		MYSQL_ROW row;
+		while (!failed && (row = mysql_fetch_row(res)) != NULL)
+		{
+			unsigned long* lengths = mysql_fetch_lengths(res);
+
+			if (query->GetFormat() == FORMAT_CSV)
+				AppendCSVRow(line, row, lengths, count);
+			else
+			{
+				AppendJSONRow(line, row, lengths, fields, count, query->GetUseNumbers());
+				line.push_back('\n');
+			}
+
+			failed = fwrite(line.data(), 1, line.length(), file) != line.length();
+			bytes += line.length();
+			rows++;
+			line.clear();
+
+			// Killed by the watchdog or Cancel, the fetch error below reports it
+			if (query->IsCancelled() || query->IsTimedOut())
+				break;
+		}
+	}
+
+	// Also reads whatever a failed write left unfetched
+	unsigned int fetcherror = mysql_errno(mysql);
+	std::string fetchmessage(mysql_error(mysql));
+	if (res != NULL)
+		mysql_free_result(res);
+
+	if (file != NULL && fclose(file) != 0)
+		failed = true;
+
+	if (file == NULL)
+	{
+		result->SetErrorID(errno);
+		result->SetError(("Unable to open " + temp).c_str());
+	}
+	else if (failed)
+	{
+		result->SetErrorID(errno);
+		result->SetError(("Unable to write " + temp).c_str());
+	}
+	else if (query->IsCancelled() || query->IsTimedOut())
+	{
+		// DoExecute fills in which of the two it was
+		result->SetErrorID(QUERY_ERROR_CANCELLED);
+	}
+	else if (fetcherror != 0)
+	{
+		result->SetErrorID(fetcherror);
+		result->SetError(fetchmessage.c_str());
+	}
+	else
+	{
+		remove(query->GetExportPath().c_str());
+		if (rename(temp.c_str(), query->GetExportPath().c_str()) != 0)
+		{
+			result->SetErrorID(errno);
+			result->SetError(("Unable to move the export to " + query->GetExportPath()).c_str());
+		}
+		else
+			result->SetExported(rows, bytes);
+	}
+
+	if (result->GetErrorID() != 0)
+		remove(temp.c_str());
+
+	// Only the first result set is exported, the rest still have to be read off the connection
+	while (mysql_next_result(mysql) == 0)
+	{
+		MYSQL_RES* rest = mysql_store_result(mysql);
+		if (rest)
+			mysql_free_result(rest);
+	}
+}
+
+// Neither direction ever holds more than a chunk of the blob in a buffer of ours. Reading still has
+// libmysql receive the whole row as one packet, fetch_column only spares the copies after that.
+void Database::ExportBlob(MYSQL* mysql, Query* query)
+{
+	Result* result = new Result();
+	query->AddResult(result);
+
+	MYSQL_STMT* stmt = mysql_stmt_init(mysql);
+	bool ok = stmt != NULL && mysql_stmt_prepare(stmt, query->GetQuery().c_str(), query->GetQueryLength()) == 0 &&
+		mysql_stmt_execute(stmt) == 0;
+	query->MarkExecuted();
+
+	if (!ok)
+	{
+		result->SetErrorID(stmt ? mysql_stmt_errno(stmt) : CR_OUT_OF_MEMORY);
+		result->SetError(stmt ? mysql_stmt_error(stmt) : "Out of memory");
+		if (stmt)
+			mysql_stmt_close(stmt);
+		return;
+	}
+
+	// Nothing is copied at fetch time, every column only reports its length
+	unsigned int count = mysql_stmt_field_count(stmt);
+	std::vector<MYSQL_BIND> columns(count);
+	std::vector<unsigned long> lengths(count);
+	std::vector<my_bool> nulls(count);
+	memset(columns.data(), 0, sizeof(MYSQL_BIND) * count);
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		columns[i].buffer_type = MYSQL_TYPE_BLOB;
+		columns[i].length = &lengths[i];
+		columns[i].is_null = &nulls[i];
+	}
+
+	int fetched = MYSQL_NO_DATA;
+	if (count > 0)
+		fetched = mysql_stmt_bind_result(stmt, columns.data()) == 0 ? mysql_stmt_fetch(stmt) : 1;
+
+	// No row, no file
+	if (fetched == MYSQL_NO_DATA)
+	{
+		result->SetExported(0, 0);
+		mysql_stmt_close(stmt);
+		return;
+	}
+
+	if (fetched == 1)
+	{
+		result->SetErrorID(mysql_stmt_errno(stmt));
+		result->SetError(mysql_stmt_error(stmt));
+		mysql_stmt_close(stmt);
+		return;
+	}
+
+	std::string temp(query->GetExportPath() + ".tmp");
+	FILE* file = fopen(temp.c_str(), "wb");
+	bool failed = file == NULL;
+
+	std::vector<char> chunk(BLOB_CHUNK_SIZE);
+	unsigned long offset = 0;
+
+	while (!failed && !nulls[0] && offset < lengths[0])
+	{
+		unsigned long length = 0;
+		MYSQL_BIND part;
+		memset(&part, 0, sizeof(part));
+		part.buffer_type = MYSQL_TYPE_BLOB;
+		part.buffer = chunk.data();
+		part.buffer_length = (unsigned long)chunk.size();
+		part.length = &length;
+
+		if (mysql_stmt_fetch_column(stmt, &part, 0, offset) != 0)
+		{
+			result->SetErrorID(mysql_stmt_errno(stmt));
+			result->SetError(mysql_stmt_error(stmt));
+			break;
+		}
+
+		size_t size = lengths[0] - offset < chunk.size() ? lengths[0] - offset : chunk.size();
+		failed = fwrite(chunk.data(), 1, size, file) != size;
+		offset += (unsigned long)size;
+	}
+
+	if (file != NULL && fclose(file) != 0)
+		failed = true;
+
+	if (file == NULL)
+	{
+		result->SetErrorID(errno);
+		result->SetError(("Unable to open " + temp).c_str());
+	}
+	else if (failed)
+	{
+		result->SetErrorID(errno);
+		result->SetError(("Unable to write " + temp).c_str());
+	}
+	else if (result->GetErrorID() == 0)
+	{
+		remove(query->GetExportPath().c_str());
+		if (rename(temp.c_str(), query->GetExportPath().c_str()) != 0)
+		{
+			result->SetErrorID(errno);
+			result->SetError(("Unable to move the blob to " + query->GetExportPath()).c_str());
+		}
+		else
+			result->SetExported(1, offset);
+	}
+
+	if (result->GetErrorID() != 0)
+		remove(temp.c_str());
+
+	// Reads and discards any further rows
+	mysql_stmt_close(stmt);
+}
+
+void Database::ImportBlob(MYSQL* mysql, Query* query)
+{
+	Result* result = new Result();
+	query->AddResult(result);
+
+	FILE* file = fopen(query->GetImportPath().c_str(), "rb");
+	if (file == NULL)
+	{
+		result->SetErrorID(errno);
+		result->SetError(("Unable to open " + query->GetImportPath()).c_str());
+		return;
+	}
+
+	const std::vector<std::string>& parameters = query->GetParameters();
+	unsigned int blob = (unsigned int)parameters.size();
+
+	std::vector<char> chunk(BLOB_CHUNK_SIZE);
+	std::vector<MYSQL_BIND> binds(blob + 1);
+	std::vector<unsigned long> lengths(blob + 1);
+	memset(binds.data(), 0, sizeof(MYSQL_BIND) * binds.size());
+
+	for (unsigned int i = 0; i < blob; i++)
+	{
+		lengths[i] = (unsigned long)parameters[i].length();
+		binds[i].buffer_type = MYSQL_TYPE_STRING;
+		binds[i].buffer = (void*)parameters[i].data();
+		binds[i].buffer_length = lengths[i];
+		binds[i].length = &lengths[i];
+	}
+
+	// Only used as an empty value when the file is empty and no long data was sent
+	binds[blob].buffer_type = MYSQL_TYPE_BLOB;
+	binds[blob].buffer = chunk.data();
+	binds[blob].length = &lengths[blob];
+
+	MYSQL_STMT* stmt = mysql_stmt_init(mysql);
+	bool ok = stmt != NULL && mysql_stmt_prepare(stmt, query->GetQuery().c_str(), query->GetQueryLength()) == 0 &&
+		mysql_stmt_bind_param(stmt, binds.data()) == 0;
+
+	bool readfailed = false;
+	while (ok && !query->IsCancelled() && !query->IsTimedOut())
+	{
+		size_t size = fread(chunk.data(), 1, chunk.size(), file);
+		if (size > 0)
+			ok = mysql_stmt_send_long_data(stmt, blob, chunk.data(), (unsigned long)size) == 0;
+
+		if (size < chunk.size())
+		{
+			readfailed = ferror(file) != 0;
+			break;
+		}
+	}
+	fclose(file);
+
+	bool interrupted = query->IsCancelled() || query->IsTimedOut();
+	if (ok && !readfailed && !interrupted)
+		ok = mysql_stmt_execute(stmt) == 0;
+	query->MarkExecuted();
+
+	if (readfailed)
+	{
+		result->SetErrorID(errno);
+		result->SetError(("Unable to read " + query->GetImportPath()).c_str());
+	}
+	else if (interrupted)
+	{
+		// DoExecute fills in which of the two it was
+		result->SetErrorID(QUERY_ERROR_CANCELLED);
+	}
+	else if (!ok)
+	{
+		result->SetErrorID(stmt ? mysql_stmt_errno(stmt) : CR_OUT_OF_MEMORY);
+		result->SetError(stmt ? mysql_stmt_error(stmt) : "Out of memory");
+	}
+	else
+	{
+		result->SetAffected((double)mysql_stmt_affected_rows(stmt));
+		result->SetLastID((double)mysql_stmt_insert_id(stmt));
+	}
+
+	if (stmt)
+		mysql_stmt_close(stmt);
+}
+
+// Slow query log and statement statistics, only measured while one of them is on
+void Database::RecordStatistics(Query* query)
+{
+	double elapsed = query->GetExecuteTime() + query->GetFetchTime();
+	double threshold = m_dSlowQueryThreshold;
+
+	bool slow = threshold > 0 && elapsed >= threshold;
+	bool stats = statementStats.IsEnabled();
+
+	if (!slow && !stats)
+		return;
+
+	double rows, bytes;
+	int errorid;
+	MeasureResults(query, rows, bytes, errorid);
+
+	if (stats)
+		statementStats.Record(query->GetQuery(), elapsed, rows, bytes);
+
+	if (!slow)
+		return;
+
+	SlowQueryEntry entry;
+	snprintf(entry.query, sizeof(entry.query), "%s", query->GetQuery().c_str());
+	snprintf(entry.source, sizeof(entry.source), "%s", query->GetSource().c_str());
+	entry.when = time(NULL);
+	entry.queuetime = query->GetQueueTime();
+	entry.exectime = query->GetExecuteTime();
+	entry.fetchtime = query->GetFetchTime();
+	entry.rows = rows;
+	entry.bytes = bytes;
+	entry.errorid = errorid;
+	entry.explained = false;
+	entry.access[0] = 0;
+	entry.key[0] = 0;
+	entry.examined = 0;
+	entry.filesort = false;
+	entry.temporary = false;
+	entry.fullscan = false;
+
+	// Single SELECTs only, anything with a ; could carry a second statement into the EXPLAIN
+	if (m_bExplainSlowQueries && errorid == 0 && IsReadQuery(query->GetQuery().c_str()) &&
+		query->GetQuery().find(';') == std::string::npos)
+	{
+		Post(sharedExecutor.GetWorkService(), std::bind(&Database::ExplainSlowQuery, this, query->GetQuery(), entry));
+		return;
+	}
+
+	RecordSlowQuery(entry);
+}
+
+// Worker thread. Only borrows a connection nobody is using, under load the entry goes in unexplained
+void Database::ExplainSlowQuery(const std::string& query, SlowQueryEntry entry)
+{
+	MYSQL* mysql = TryGetAvailableConnection();
+	if (mysql != NULL)
+	{
+		std::string explain("EXPLAIN FORMAT=JSON ");
+		explain.append(query);
+
+		if (mysql_real_query(mysql, explain.c_str(), explain.length()) == 0)
+		{
+			MYSQL_RES* result = mysql_store_result(mysql);
+			if (result)
+			{
+				MYSQL_ROW row = mysql_fetch_row(result);
+				if (row && row[0])
+					SummarizeExplain(std::string(row[0], mysql_fetch_lengths(result)[0]), entry);
+				mysql_free_result(result);
+			}
+		}
+
+		ReturnConnection(mysql);
+	}
+
+	RecordSlowQuery(entry);
+}
+
+void Database::RecordSlowQuery(const SlowQueryEntry& entry)
+{
+	m_slowLog.Record(entry);
+
+	std::string path;
+	{
+		std::lock_guard<std::mutex> guard(m_SlowLogMutex);
+		path = m_strSlowLogPath;
+	}
+
+	if (!path.empty())
+		Post(sharedExecutor.GetTimerService(), std::bind(&AppendSlowQueryLog, path, m_strDB, entry));
+}
+
+void Database::DoExecute(Query* query)
+{
+	query->MarkStarted();
+
+	if (query->IsCancelled())
+	{
+		FailQuery(query, QUERY_ERROR_CANCELLED, "Query cancelled");
+		return;
+	}
+
+	MYSQL* pMYSQL = GetAvailableConnection();
+
+	if (pMYSQL == NULL)
+	{
+		std::lock_guard<std::mutex> guard(m_AvailableMutex);
+		FailQuery(query, CR_CONN_HOST_ERROR, m_strConnectError.c_str());
+		return;
+	}
+
+	const char* strquery = query->GetQuery().c_str();
+	size_t len = query->GetQueryLength();
+
+	{
+		std::lock_guard<std::mutex> guard(m_ActiveMutex);
+		query->SetConnection(pMYSQL);
+	}
+
+	std::shared_ptr<asio::steady_timer> watchdog;
+	if (query->GetTimeout() > 0)
+	{
+		watchdog = std::make_shared<asio::steady_timer>(sharedExecutor.GetTimerService());
+		watchdog->expires_from_now(std::chrono::milliseconds((long long)(query->GetTimeout() * 1000)));
+		unsigned int id = query->GetID();
+
+		BeginTask();
+		watchdog->async_wait([this, id](const system::error_code& ec)
+		{
+			if (!ec)
+				Post(sharedExecutor.GetKillService(), std::bind(&Database::KillQuery, this, id, true));
+			EndTask();
+		});
+	}
+
+	// Blobs go through prepared statements, which mark themselves executed
+	bool prepared = query->GetFormat() == FORMAT_BLOB || !query->GetImportPath().empty();
+	if (!prepared)
+	{
+		mysql_real_query(pMYSQL, strquery, len);
+		query->MarkExecuted();
+	}
+
+	if (query->GetFormat() == FORMAT_BLOB)
+		ExportBlob(pMYSQL, query);
+	else if (!query->GetImportPath().empty())
+		ImportBlob(pMYSQL, query);
+	else if (query->GetFormat() == FORMAT_CSV || query->GetFormat() == FORMAT_NDJSON)
+		ExportResults(pMYSQL, query);
+	else
+	{
+		int status;
+		do {
+			MYSQL_RES* pResult = mysql_store_result(pMYSQL);
+			unsigned int errorno = mysql_errno(pMYSQL);
+
+			Result* result = new Result();
+			{
+				result->SetResult(pResult);
+				result->SetErrorID(errorno);
+				result->SetError(mysql_error(pMYSQL));
+				result->SetAffected((double)mysql_affected_rows(pMYSQL));
+				result->SetLastID((double)mysql_insert_id(pMYSQL));
+			}
+
+			if (pResult && query->GetSchema())
+			{
+				DecoderPlan plan;
+				std::string error;
+
+				if (query->GetSchema()->Plan(mysql_fetch_fields(pResult), mysql_num_fields(pResult), plan, error))
+					result->SetPlan(plan);
+				else
+				{
+					result->FreeResult();
+					result->SetErrorID(QUERY_ERROR_SCHEMA);
+					result->SetError(error.c_str());
+				}
+			}
+
+			query->AddResult(result);
+			status = mysql_next_result(pMYSQL);
+		} while (status != -1);
+	}
+
+	query->MarkFinished();
+
+	{
+		std::unique_lock<std::mutex> lock(m_ActiveMutex);
+		m_KillCV.wait(lock, [&]() { return !query->IsBeingKilled(); });
+		query->SetConnection(NULL);
+	}
+
+	if (watchdog)
+		watchdog->cancel();
+
+	// Interrupted by us, report it as such rather than as a server error
+	if (query->IsTimedOut() || query->IsCancelled())
+	{
+		Result* result = query->GetResults().back();
+		result->SetErrorID(query->IsTimedOut() ? QUERY_ERROR_TIMEOUT : QUERY_ERROR_CANCELLED);
+		result->SetError(query->IsTimedOut() ? "Query timed out" : "Query cancelled");
+	}
+
+	// The next page runs straight after this one, queued once this one is out so pages complete in order
+	Query* next = NULL;
+	std::shared_ptr<TableScan> scan = query->GetScan();
+	if (scan && scan->PageCompleted(pMYSQL, query->GetResults().front(), !m_bShuttingDown))
+		next = NewScanPage(scan);
+
+	RecordStatistics(query);
+
+	PushCompleted(query);
+	ReturnConnection(pMYSQL);
+
+	if (next)
+		QueueContinuation(next);
 }
\ No newline at end of file
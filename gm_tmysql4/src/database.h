@@ -1,16 +1,43 @@
 #include <deque>
 #include <atomic>
 #include <mutex>
+#include <condition_variable>
 #include <thread>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
 
 using namespace boost;
 
-#define NUM_THREADS_DEFAULT 2
-#define NUM_CON_DEFAULT NUM_THREADS_DEFAULT
+#define NUM_CON_DEFAULT 2
+#define KILL_TIMEOUT 5	// Seconds, connecting and talking over the kill connection
+#define SHUTDOWN_GRACE 5	// Seconds past a shutdown deadline for killed queries to let go, twice if sockets have to be shut down
+#define BLOB_CHUNK_SIZE (1 << 16)
+#define WRITE_BUFFER_MAX_BYTES (64 << 20)	// Write-behind never buffers more than this, whatever the queue limits say
 
 #undef ENABLE_QUERY_TIMERS
 
+// Error IDs reported for queries that never got a result from the server
+enum
+{
+	QUERY_ERROR_TIMEOUT = -1,
+	QUERY_ERROR_CANCELLED = -2,
+	QUERY_ERROR_REJECTED = -3,
+	QUERY_ERROR_DROPPED = -4,
+	QUERY_ERROR_SHUTDOWN = -5,
+	QUERY_ERROR_SCHEMA = -6,		// The result didn't have the columns of the query's schema
+};
+
+// What QueueQuery does once a database is over its queue limits
+enum BackpressurePolicy
+{
+	BACKPRESSURE_REJECT,
+	BACKPRESSURE_DROP_OLDEST,
+	BACKPRESSURE_BLOCK,
+};
+
 #ifdef ENABLE_QUERY_TIMERS
 class Timer
 {
@@ -72,7 +99,7 @@ private:
 class Result
 {
 public:
-	Result()
+	Result() : m_iError(0), m_iLastID(0), m_iAffected(0), m_pResult(NULL), m_bExported(false), m_dExportedRows(0), m_dExportedBytes(0)
 	{
 	}
 
@@ -94,23 +121,81 @@ public:
 	double				GetAffected(void) { return m_iAffected; }
 
 	void				SetResult(MYSQL_RES* result) { m_pResult = result; }
+
+	// Set by the worker when the query has a schema and the result matched it
+	void				SetPlan(DecoderPlan& plan) { m_plan.swap(plan); }
+	const DecoderPlan&	GetPlan(void) { return m_plan; }
+
+	void				FreeResult(void) { mysql_free_result(m_pResult); m_pResult = NULL; }
 	MYSQL_RES*			GetResult() { return m_pResult; }
 
+	// Replaces the MYSQL_RES with its decoded rows, done by the worker so the main thread only pushes values
+	void				Decode(void) { if (m_pResult) { m_decoded.Decode(m_pResult, m_plan); FreeResult(); } }
+	const DecodedResult& GetDecoded(void) { return m_decoded; }
+
+	// Written to a file by the worker instead of being kept
+	void				SetExported(double rows, double bytes) { m_bExported = true; m_dExportedRows = rows; m_dExportedBytes = bytes; }
+	bool				IsExported(void) { return m_bExported; }
+	double				GetExportedRows(void) { return m_dExportedRows; }
+	double				GetExportedBytes(void) { return m_dExportedBytes; }
+
 private:
 	std::string			m_strError;
 	int					m_iError;
 	double				m_iLastID;
 	double				m_iAffected;
 	MYSQL_RES*			m_pResult;
+	DecoderPlan			m_plan;
+	DecodedResult		m_decoded;
+	bool				m_bExported;
+	double				m_dExportedRows;
+	double				m_dExportedBytes;
 };
 
 typedef std::vector<Result*> Results;
 
+// How the worker hands over a query's rows
+enum QueryFormat
+{
+	FORMAT_TABLE,		// Decoded by the worker, turned into Lua tables on the main thread
+	FORMAT_JSON,		// One JSON string shaped like the results table
+	FORMAT_CSV,			// Streamed to the export path
+	FORMAT_NDJSON,
+	FORMAT_BLOB,		// First column of the first row streamed raw to the export path
+};
+
+// Per-query settings from the Lua options table
+struct QueryOptions
+{
+	QueryOptions() : timeout(-1), durable(false), format(FORMAT_TABLE), cache(false) {}
+
+	double		timeout;	// Seconds, < 0 uses the database default
+	bool		durable;	// Still runs when the database is shut down with a deadline
+	QueryFormat	format;
+	std::string	schema;		// Name of a schema registered on the database, empty for none
+	std::string	source;		// Lua location for the slow query log, only filled in while it's on
+	bool		cache;		// Keep the results until a table they read changes, needs tables
+	std::vector<std::string> tables;	// "table" or "db.table" tags for cache invalidation
+	std::string	lane;		// Queries of the same lane run one at a time in submission order
+};
+
+class TableScan;
+
+// Callers attached to an identical in-flight query, each with an ID of its own to cancel by
+struct Follower
+{
+	unsigned int	id;
+	int				callback;
+};
+typedef std::vector<Follower> Followers;
+
 class Query
 {
 public:
-	Query(const char* query, int callback = -1, int callbackref = -1, bool usenumbers = false) :
-		m_strQuery(query), m_iCallback(callback), m_iCallbackRef(callbackref), m_bUseNumbers(usenumbers)
+	Query(const char* query, int callback = -1, bool usenumbers = false) :
+		m_strQuery(query), m_iCallback(callback), m_bUseNumbers(usenumbers), m_iID(0), m_dTimeout(0), m_bDurable(false),
+		m_iFormat(FORMAT_TABLE), m_pConnection(NULL), m_iThreadID(0), m_iKills(0), m_bCancelled(false), m_bTimedOut(false),
+		m_tQueued(std::chrono::steady_clock::now()), m_iCacheGeneration(0), m_iCachedRef(-1)
 	{
 	}
 
@@ -123,11 +208,104 @@ public:
 	const std::string&	GetQuery(void) { return m_strQuery; }
 	size_t				GetQueryLength(void) { return m_strQuery.length(); }
 
+	// Slot in the module's callback table, -1 for none
 	int					GetCallback(void) { return m_iCallback; }
-	int					GetCallbackRef(void) { return m_iCallbackRef; }
+	void				SetCallback(int callback) { m_iCallback = callback; }
 
 	bool				GetUseNumbers(void) { return m_bUseNumbers; }
 
+	void				SetID(unsigned int id) { m_iID = id; }
+	unsigned int		GetID(void) { return m_iID; }
+
+	void				SetTimeout(double seconds) { m_dTimeout = seconds; }
+	double				GetTimeout(void) { return m_dTimeout; }
+
+	void				SetDurable(bool durable) { m_bDurable = durable; }
+	bool				IsDurable(void) { return m_bDurable; }
+
+	void				SetSource(const std::string& source) { m_strSource = source; }
+	const std::string&	GetSource(void) { return m_strSource; }
+
+	void				SetSchema(const SchemaPtr& schema) { m_schema = schema; }
+	const SchemaPtr&	GetSchema(void) { return m_schema; }
+
+	void				SetLane(const std::string& lane) { m_strLane = lane; }
+	const std::string&	GetLane(void) { return m_strLane; }
+
+	void				SetFormat(QueryFormat format) { m_iFormat = format; }
+	QueryFormat			GetFormat(void) { return m_iFormat; }
+
+	void				SetExportPath(const std::string& path) { m_strExportPath = path; }
+	const std::string&	GetExportPath(void) { return m_strExportPath; }
+
+	// Run as a prepared statement, the parameters bound as strings and the file streamed into one more after them
+	void				SetImport(const std::vector<std::string>& parameters, const std::string& path) { m_parameters = parameters; m_strImportPath = path; }
+	const std::vector<std::string>& GetParameters(void) { return m_parameters; }
+	const std::string&	GetImportPath(void) { return m_strImportPath; }
+
+	// A page of a table scan, dispatched to the scan instead of a callback slot
+	void				SetScan(const std::shared_ptr<TableScan>& scan) { m_scan = scan; }
+	const std::shared_ptr<TableScan>& GetScan(void) { return m_scan; }
+
+	// FORMAT_JSON results, encoded by whoever completes the query
+	void				SetEncoded(std::string& encoded) { m_strEncoded.swap(encoded); }
+	const std::string&	GetEncoded(void) { return m_strEncoded; }
+
+	// Phase timestamps, set by the worker running it
+	void				MarkStarted(void) { m_tStarted = std::chrono::steady_clock::now(); }
+	void				MarkExecuted(void) { m_tExecuted = std::chrono::steady_clock::now(); }
+	void				MarkFinished(void) { m_tFinished = std::chrono::steady_clock::now(); }
+
+	double				GetQueueTime(void) { return std::chrono::duration<double>(m_tStarted - m_tQueued).count(); }
+	double				GetExecuteTime(void) { return std::chrono::duration<double>(m_tExecuted - m_tStarted).count(); }
+	double				GetFetchTime(void) { return std::chrono::duration<double>(m_tFinished - m_tExecuted).count(); }
+
+	// Connection and its thread ID while executing, NULL and 0 otherwise. Guarded by Database::m_ActiveMutex
+	void				SetConnection(MYSQL* mysql) { m_pConnection = mysql; m_iThreadID = mysql ? mysql_thread_id(mysql) : 0; }
+	MYSQL*				GetConnection(void) { return m_pConnection; }
+	unsigned long		GetThreadID(void) { return m_iThreadID; }
+
+	void				SetCancelled(void) { m_bCancelled = true; }
+	bool				IsCancelled(void) { return m_bCancelled; }
+
+	// KILLs being sent for it. Guarded by Database::m_ActiveMutex
+	void				BeginKill(void) { m_iKills++; }
+	void				EndKill(void) { m_iKills--; }
+	bool				IsBeingKilled(void) { return m_iKills > 0; }
+
+	void				SetTimedOut(void) { m_bTimedOut = true; }
+	bool				IsTimedOut(void) { return m_bTimedOut; }
+
+	// Main thread only, the worker never looks at these
+	void				SetCoalesceKey(const std::string& key) { m_strCoalesceKey = key; }
+	const std::string&	GetCoalesceKey(void) { return m_strCoalesceKey; }
+	void				AddFollower(unsigned int id, int callback) { Follower follower = { id, callback }; m_Followers.push_back(follower); }
+	const Followers&	GetFollowers(void) { return m_Followers; }
+
+	bool				RemoveFollower(unsigned int id, int& callback)
+	{
+		for (auto iter = m_Followers.begin(); iter != m_Followers.end(); ++iter)
+		{
+			if (iter->id == id)
+			{
+				callback = iter->callback;
+				m_Followers.erase(iter);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Where the results go in the query cache, and the cache generation it was queued in
+	void				SetCacheKey(const std::string& key, const std::vector<std::string>& tables, unsigned int generation) { m_strCacheKey = key; m_cacheTables = tables; m_iCacheGeneration = generation; }
+	const std::string&	GetCacheKey(void) { return m_strCacheKey; }
+	const std::vector<std::string>& GetCacheTables(void) { return m_cacheTables; }
+	unsigned int		GetCacheGeneration(void) { return m_iCacheGeneration; }
+
+	// Registry reference to results served from the cache, -1 for a query that ran
+	void				SetCachedRef(int ref) { m_iCachedRef = ref; }
+	int					GetCachedRef(void) { return m_iCachedRef; }
+
 	void				AddResult(Result* result) { m_pResults.push_back(result); }
 	Results				GetResults(void) { return m_pResults; }
 
@@ -141,9 +319,39 @@ private:
 
 	std::string			m_strQuery;
 	int					m_iCallback;
-	int					m_iCallbackRef;
 	bool				m_bUseNumbers;
 
+	unsigned int		m_iID;
+	double				m_dTimeout;
+	bool				m_bDurable;
+	QueryFormat			m_iFormat;
+	std::string			m_strLane;
+	SchemaPtr			m_schema;
+	std::string			m_strExportPath;
+	std::string			m_strImportPath;
+	std::vector<std::string> m_parameters;
+	std::shared_ptr<TableScan> m_scan;
+	std::string			m_strEncoded;
+	MYSQL*				m_pConnection;
+	unsigned long		m_iThreadID;
+	int					m_iKills;
+	std::atomic<bool>	m_bCancelled;
+	std::atomic<bool>	m_bTimedOut;
+
+	std::string			m_strSource;
+	std::chrono::steady_clock::time_point m_tQueued;
+	std::chrono::steady_clock::time_point m_tStarted;
+	std::chrono::steady_clock::time_point m_tExecuted;
+	std::chrono::steady_clock::time_point m_tFinished;
+
+	std::string			m_strCoalesceKey;
+	Followers			m_Followers;
+
+	std::string			m_strCacheKey;
+	std::vector<std::string> m_cacheTables;
+	unsigned int		m_iCacheGeneration;
+	int					m_iCachedRef;
+
 	Results				m_pResults;
 
 #ifdef ENABLE_QUERY_TIMERS
@@ -160,29 +368,180 @@ public:
 	Database(const char* host, const char* user, const char* pass, const char* db, int port, const char* socket, int flags);
 	~Database(void);
 
+	// Connections are opened in parallel on the shared executor
 	bool			Initialize(std::string& error);
+	void			InitializeAsync(void);
+	bool			PopConnectResult(bool& success, std::string& error);
+
+	void			SetConnectCallback(int callback) { m_iConnectCallback = callback; }
+	int				GetConnectCallback(void) { return m_iConnectCallback; }
+
+	// Deadline in seconds, < 0 waits for every queued query like Shutdown always did
+	void			BeginShutdown(double deadline = -1);
 	void			Shutdown(void);
-	std::size_t		RunShutdownWork(void);
+	const std::vector<std::string>& GetDroppedOnShutdown(void) { return m_droppedOnShutdown; }
+
+	// Something still ran on it past the shutdown grace period. It must be leaked rather than released then
+	bool			IsAbandoned(void) { return m_bAbandoned; }
 	void			Release(void);
 
-	const char*		GetDatabase(void) { return m_strDB; }
+	const char*		GetDatabase(void) { return m_strDB.c_str(); }
 	bool			SetCharacterSet(const char* charset, std::string& error);
 	char*			Escape(const char* query);
-	void			QueueQuery(const char* query, int callback = -1, int callbackref = -1, bool usenumbers = false);
+	unsigned int	QueueQuery(const char* query, int callback = -1, bool usenumbers = false, const QueryOptions& options = QueryOptions());
+	// Streams the first result set to path with mysql_use_result, the callback only sees row and byte counts
+	unsigned int	QueueExport(const char* query, const char* path, QueryFormat format, int callback = -1, const QueryOptions& options = QueryOptions());
+	// Upserts the row with the given key columns and values, the file goes into column in chunks
+	unsigned int	QueueBlobWrite(const char* table, const std::vector<std::pair<std::string, std::string> >& keys, const char* column, const char* path, int callback = -1, const QueryOptions& options = QueryOptions());
+	// Main thread, queues the scan's next page with the scan's options. False once the database is shutting down
+	bool			QueueScanPage(const std::shared_ptr<TableScan>& scan);
+	bool			CancelQuery(unsigned int id);
+
+	// Must be called before Initialize, also caps how many queries run at once
+	void			SetConnectionCount(unsigned int count) { m_iNumConnections = count > 0 ? count : 1; }
+
+	// Must be called before Initialize, applied to every connection
+	void			SetNetTimeouts(unsigned int readtimeout, unsigned int writetimeout) { m_iReadTimeout = readtimeout; m_iWriteTimeout = writetimeout; }
+	void			SetQueryTimeout(double seconds) { m_dQueryTimeout = seconds; }
+
+	// 0 disables a limit. Queries count until executed, bytes only while still queued
+	void			SetQueueLimits(unsigned int maxqueries, size_t maxbytes, BackpressurePolicy policy);
+	bool			IsOverQueueLimits(size_t querylength);
+
+	unsigned int	GetInFlightCount(void) { return m_iInFlight; }
+	size_t			GetQueuedBytes(void) { return m_iQueuedBytes; }
+	unsigned int	GetRejectedCount(void) { return m_iRejected; }
+	unsigned int	GetDroppedCount(void) { return m_iDropped; }
+
+	// Identical SELECTs submitted while one is in flight share its result
+	void			SetCoalesceReads(bool enabled) { m_bCoalesceReads = enabled; }
+	unsigned int	GetCoalescedCount(void) { return m_iCoalesced; }
+
+	// Queries running longer than the threshold (seconds, 0 disables) are kept in a ring buffer
+	// and, with a path set, appended to that file from the timer thread
+	void			SetSlowQueryLog(double threshold, const char* path);
+	bool			IsSlowQueryLogEnabled(void) { return m_dSlowQueryThreshold > 0; }
+	// Slow SELECTs are run again as EXPLAIN FORMAT=JSON on an idle connection before they're logged
+	void			SetExplainSlowQueries(bool explain) { m_bExplainSlowQueries = explain; }
+	void			GetSlowQueries(std::vector<SlowQueryEntry>& entries) { m_slowLog.Snapshot(entries); }
+
+	// Callback-less writes are buffered and sent as multi-statement batches on their own connection,
+	// once maxstatements or maxbytes is reached or interval seconds after the first one was buffered
+	void			SetWriteBehind(bool enabled, unsigned int maxstatements, size_t maxbytes, double interval);
+	size_t			GetWriteBehindCount(void);
+	unsigned int	GetWriteBehindFlushed(void) { return m_iWritesFlushed; }
+	unsigned int	GetWriteBehindBatches(void) { return m_iWriteBatches; }
+
+	// Keeps only the latest statement per key, main thread only. Pending statements are queued
+	// in first-seen key order once the flush interval has passed since the first of them
+	void			UpsertCoalesced(const char* key, const char* query);
+	void			SetUpsertInterval(double interval) { m_dUpsertInterval = interval; }
+	void			FlushCoalesced(bool force);
+	size_t			GetUpsertPendingCount(void) { return m_upserts.size(); }
+	unsigned int	GetUpsertSavedCount(void) { return m_iUpsertsSaved; }
+
+	// Main thread only, replaces any schema of the same name
+	void			RegisterSchema(const SchemaPtr& schema) { m_schemas[schema->GetName()] = schema; }
+	SchemaPtr		FindSchema(const std::string& name);
+
+	// Coalescing and cache key, identical queries that would give identical Lua values share one
+	static std::string GetQueryKey(const char* query, bool usenumbers, const QueryOptions& options);
+	static bool		IsReadQuery(const char* query);
+	// `name`, or `db`.`name`
+	static std::string QuoteIdentifier(const std::string& name);
+
+	// Main thread only. Results cached under the query's key are completed with a copy of their reference
+	QueryCache&		GetQueryCache(void) { return m_queryCache; }
+	void			QueueCachedResult(const char* query, int callback, bool usenumbers, int ref);
+	// Whether none of tables was invalidated since generation, results queued then may still be stored
+	bool			IsCacheCurrent(const std::vector<std::string>& tables, unsigned int generation);
+
+	// Drops the entries tagged with table ("db.table", or "table" for our own database), everything when it's empty.
+	// Main thread only, the references the entries held are appended to freed.
+	void			InvalidateCache(const std::string& table, std::vector<int>& freed);
+
+	// Follows the binary log on a thread of its own, changed tables are invalidated on the next dispatch.
+	// False when the client library can't.
+	bool			EnableBinlogInvalidation(unsigned int serverid, std::string& error);
+	bool			PopInvalidations(std::vector<std::string>& tables);
 
 	Query*			GetCompletedQueries();
+	// Main thread, hands back what a dispatch ran out of time for. It comes first next time.
+	void			DeferCompletedQueries(Query* queries) { m_pDeferredCompleted = queries; }
+
+	// Main thread. A callback may disconnect the database it's called for, it's only freed once every dispatch
+	// running for it has returned. LeaveDispatch says whether that's now.
+	void			EnterDispatch() { m_iDispatchDepth++; }
+	bool			LeaveDispatch() { return --m_iDispatchDepth == 0 && m_bDisconnected; }
+	void			SetDisconnected() { m_bDisconnected = true; }
+	bool			IsDisconnected() const { return m_bDisconnected; }
 
 private:
-	bool		Connect(MYSQL* mysql, std::string& error);
+	bool		Connect(MYSQL* mysql, std::string& error, int extraflags = 0, bool timeouts = true);
 
-	void		QueueQuery(Query* query);
+	void		StartConnecting(void);
+	void		ConnectOne(bool escape);
 
+	void		QueueQuery(Query* query);
+	void		QueueContinuation(Query* query);
+	Query*		NewScanPage(const std::shared_ptr<TableScan>& scan);
+	void		FailQuery(Query* query, int errorid, const char* error);
+	void		DetachCancelled(Query* shared, int callback);
+
+	void		Schedule(void);
+	void		PushPending(Query* query);
+	void		ReleaseLane(Query* query);
+	void		TakePending(std::vector<Query*>& taken);
+	Query*		TakeOldestPending(void);
+	void		RunNext(void);
 	void		DoExecute(Query* query);
+	void		ExportResults(MYSQL* mysql, Query* query);
+	void		ExportBlob(MYSQL* mysql, Query* query);
+	void		ImportBlob(MYSQL* mysql, Query* query);
 	void		PushCompleted(Query* query);
 
+	void		KillQuery(unsigned int id, bool timedout);
+	void		ConnectKill(void);
+
+	void		RecordStatistics(Query* query);
+	void		ExplainSlowQuery(const std::string& query, SlowQueryEntry entry);
+	void		RecordSlowQuery(const SlowQueryEntry& entry);
+
+	void		QueueWrite(const char* query);
+	void		ArmWriteTimer(double seconds);
+	void		ScheduleWriteFlush(bool force = false);
+	void		FlushWrites(void);
+	void		ReportError(const std::string& query, int errorid, const char* error);
+
+	void		OnTableChanged(const std::string& db, const std::string& table);
+
+	// Everything handed to the shared executor is counted so Shutdown knows when it's safe to delete us
+	void		Post(asio::io_service& service, const std::function<void()>& task);
+	void		BeginTask(void);
+	void		EndTask(void);
+
+	// NULL unless one is idle right now
+	MYSQL* TryGetAvailableConnection()
+	{
+		std::lock_guard<std::mutex> guard(m_AvailableMutex);
+
+		if (m_vecAvailableConnections.empty())
+			return NULL;
+
+		MYSQL* result = m_vecAvailableConnections.front();
+		m_vecAvailableConnections.pop_front();
+		return result;
+	}
+
+	// Holds the caller until a connection is up, NULL if none could be opened
 	MYSQL* GetAvailableConnection()
 	{
-		std::lock_guard<std::recursive_mutex> guard(m_AvailableMutex);
+		std::unique_lock<std::mutex> lock(m_AvailableMutex);
+		m_AvailableCV.wait(lock, [&]() { return !m_vecAvailableConnections.empty() || (m_iPendingConnects == 0 && m_iPoolSize == 0); });
+
+		if (m_vecAvailableConnections.empty())
+			return NULL;
+
 		MYSQL* result = m_vecAvailableConnections.front();
 		m_vecAvailableConnections.pop_front();
 		return result;
@@ -190,26 +549,130 @@ private:
 
 	void ReturnConnection(MYSQL* mysql)
 	{
-		std::lock_guard<std::recursive_mutex> guard(m_AvailableMutex);
-		m_vecAvailableConnections.push_back(mysql);
+		{
+			std::lock_guard<std::mutex> guard(m_AvailableMutex);
+			m_vecAvailableConnections.push_back(mysql);
+		}
+		m_AvailableCV.notify_one();
 	}
 
 	MYSQL*	m_pEscapeConnection;
 
 	waitfree_query_queue<Query> m_completedQueries;
+	Query*				m_pDeferredCompleted;
+	int					m_iDispatchDepth;
+	bool				m_bDisconnected;
 	std::deque< MYSQL* > m_vecAvailableConnections;
 
-	mutable std::recursive_mutex m_AvailableMutex;
-
-	std::vector<std::thread> thread_group;
-	asio::io_service io_service;
-	std::auto_ptr<asio::io_service::work> work;
-
-	const char*			m_strHost;
-	const char*			m_strUser;
-	const char*			m_strPass;
-	const char*			m_strDB;
+	mutable std::mutex m_AvailableMutex;
+	std::condition_variable m_AvailableCV;
+
+	unsigned int		m_iNumConnections;
+	std::atomic<unsigned int> m_iPoolSize;
+
+	// Guarded by m_AvailableMutex
+	unsigned int		m_iPendingConnects;
+	unsigned int		m_iFailedConnects;
+	std::string			m_strConnectError;
+
+	bool				m_bConnectReported;
+	int					m_iConnectCallback;
+
+	std::mutex			m_TaskMutex;
+	std::condition_variable m_TaskCV;
+	unsigned int		m_iTasks;
+
+	// Watchdogs and Cancel hand KILL QUERY to the executor's kill thread, the only one using this
+	MYSQL*	m_pKillConnection;
+	std::condition_variable m_KillCV;	// With m_ActiveMutex, signalled as a KILL completes
+
+	// Queries waiting for a worker, at most one RunNext per connection is posted at a time
+	std::deque<Query*>	m_pendingQueries;
+	std::mutex			m_PendingMutex;
+	std::condition_variable m_PendingCV;
+	unsigned int		m_iRunning;
+	bool				m_bConnectFailed;
+
+	// Lanes with a query pending or running, and the queries of the lane waiting behind it. Only the
+	// lane's head is ever in m_pendingQueries, so everything in there can run. Guarded by m_PendingMutex
+	std::unordered_map<std::string, std::deque<Query*> > m_lanes;
+
+	unsigned int		m_iMaxQueries;
+	size_t				m_iMaxQueuedBytes;
+	BackpressurePolicy	m_iBackpressurePolicy;
+
+	std::atomic<unsigned int> m_iInFlight;
+	std::atomic<size_t>	m_iQueuedBytes;
+	std::atomic<unsigned int> m_iRejected;
+	std::atomic<unsigned int> m_iDropped;
+
+	// Main thread only
+	bool				m_bCoalesceReads;
+	unsigned int		m_iCoalesced;
+	std::unordered_map<std::string, Query*> m_coalescingQueries;
+	std::unordered_map<unsigned int, Query*> m_coalescedFollowers;	// Follower ID to the query it shares
+
+	std::unordered_map<unsigned int, Query*> m_activeQueries;
+	mutable std::mutex m_ActiveMutex;
+	std::atomic<unsigned int> m_iNextQueryID;		// Scans queue their next page from the workers
+
+	// Write-behind buffer, the timer is only touched on the timer thread
+	bool				m_bWriteBehind;
+	unsigned int		m_iWriteMaxStatements;
+	size_t				m_iWriteMaxBytes;
+	double				m_dWriteInterval;
+	std::deque<std::string> m_writeBuffer;
+	size_t				m_iWriteBufferBytes;
+	bool				m_bFlushingWrites;
+	double				m_dWriteBackoff;	// While the server is unreachable, 0 otherwise. Only timed flushes run then
+	std::mutex			m_WriteMutex;
+	std::condition_variable m_WriteCV;
+	std::shared_ptr<asio::steady_timer> m_writeTimer;
+	MYSQL*				m_pWriteConnection;
+	std::atomic<unsigned int> m_iWritesFlushed;
+	std::atomic<unsigned int> m_iWriteBatches;
+
+	std::unordered_map<std::string, SchemaPtr> m_schemas;
+
+	QueryCache			m_queryCache;
+	BinlogListener*		m_pBinlog;
+	unsigned int		m_iCacheGeneration;		// Main thread, counts invalidations
+	unsigned int		m_iCacheCleared;		// Generation everything was last dropped in
+	std::unordered_map<std::string, unsigned int> m_tableGenerations;	// Generation each table was last invalidated in
+	std::mutex			m_InvalidationMutex;
+	std::unordered_set<std::string> m_invalidations;	// "db.table", "" for everything
+
+	// Keyed upserts, main thread only
+	double				m_dUpsertInterval;
+	std::vector<std::string> m_upsertOrder;
+	std::unordered_map<std::string, std::string> m_upserts;
+	std::chrono::steady_clock::time_point m_upsertDeadline;
+	unsigned int		m_iUpsertsSaved;
+
+	std::atomic<double>	m_dSlowQueryThreshold;
+	std::atomic<bool>	m_bExplainSlowQueries;
+	std::string			m_strSlowLogPath;
+	std::mutex			m_SlowLogMutex;
+	SlowQueryLog		m_slowLog;
+
+	std::atomic<bool>	m_bShuttingDown;
+	bool				m_bShutdownDeadline;
+	std::chrono::steady_clock::time_point m_shutdownDeadline;
+	std::vector<std::string> m_droppedOnShutdown;
+	bool				m_bAbandoned;
+
+	unsigned int		m_iReadTimeout;
+	unsigned int		m_iWriteTimeout;
+	double				m_dQueryTimeout;
+
+	// Owned copies, connections may be (re)opened long after the Lua strings are gone
+	std::string			m_strHost;
+	std::string			m_strUser;
+	std::string			m_strPass;
+	std::string			m_strDB;
 	int					m_iPort;
-	const char*			m_strSocket;
+	std::string			m_strSocket;
+	bool				m_bHasSocket;
 	int					m_iClientFlags;
+	std::string			m_strCharset;	// Guarded by m_AvailableMutex, empty until SetCharacterSet succeeds
 };
\ No newline at end of file
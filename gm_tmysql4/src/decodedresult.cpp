@@ -0,0 +1,80 @@
+#include "gm_tmysql.h"
+
+#include <cstdlib>
+
+// BIT values arrive as their raw bytes, most significant first, not as text
+static unsigned long long ReadBits(const char* value, unsigned long length)
+{
+	unsigned long long bits = 0;
+	for (unsigned long i = 0; i < length; i++)
+		bits = (bits << 8) | (unsigned char)value[i];
+	return bits;
+}
+
+void DecodedResult::Decode(MYSQL_RES* result, const DecoderPlan& plan)
+{
+	m_iColumns = mysql_num_fields(result);
+	m_iRows = (size_t)mysql_num_rows(result);
+
+	MYSQL_FIELD* fields = mysql_fetch_fields(result);
+
+	m_columns.resize(m_iColumns);
+	for (unsigned int i = 0; i < m_iColumns; i++)
+		m_columns[i].assign(fields[i].name, fields[i].name_length);
+
+	m_cells.resize(m_iRows * m_iColumns);
+
+	// Text columns dominate the size of most results, one allocation per result rather than per value
+	m_arena.clear();
+
+	DecodedCell* cell = m_cells.data();
+
+	MYSQL_ROW row;
+	while ((row = mysql_fetch_row(result)) != NULL)
+	{
+		unsigned long* lengths = mysql_fetch_lengths(result);
+
+		for (unsigned int i = 0; i < m_iColumns; i++, cell++)
+		{
+			if (row[i] == NULL)
+			{
+				cell->type = DECODED_NULL;
+				continue;
+			}
+
+			SchemaType type;
+			if (!plan.empty())
+				type = plan[i]->type;
+			else if (IS_NUM(fields[i].type) && fields[i].type != MYSQL_TYPE_LONGLONG)
+				type = SCHEMA_NUMBER;
+			else
+				type = SCHEMA_STRING;
+
+			bool bits = fields[i].type == MYSQL_TYPE_BIT;
+
+			switch (type)
+			{
+			case SCHEMA_INT:
+				cell->type = DECODED_NUMBER;
+				cell->number = bits ? (double)ReadBits(row[i], lengths[i]) : (double)strtoll(row[i], NULL, 10);
+				break;
+			case SCHEMA_NUMBER:
+				cell->type = DECODED_NUMBER;
+				cell->number = bits ? (double)ReadBits(row[i], lengths[i]) : atof(row[i]);
+				break;
+			case SCHEMA_BOOL:
+				cell->type = DECODED_BOOL;
+				if (bits)
+					cell->number = ReadBits(row[i], lengths[i]) != 0 ? 1 : 0;
+				else
+					cell->number = lengths[i] > 0 && row[i][0] != '0' ? 1 : 0;
+				break;
+			default:
+				cell->type = DECODED_STRING;
+				cell->string.offset = (unsigned int)m_arena.length();
+				cell->string.length = (unsigned int)lengths[i];
+				m_arena.append(row[i], lengths[i]);
+			}
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,49 @@
+#include <string>
+#include <vector>
+
+enum DecodedType
+{
+	DECODED_NULL,
+	DECODED_NUMBER,
+	DECODED_BOOL,
+	DECODED_STRING,
+};
+
+struct DecodedCell
+{
+	union
+	{
+		double		number;		// DECODED_NUMBER, and DECODED_BOOL as 0 or 1
+		struct
+		{
+			unsigned int offset;	// Into the arena
+			unsigned int length;
+		} string;
+	};
+	unsigned char	type;
+};
+
+// A whole result set decoded on the worker, row after row of typed cells with every string in one arena.
+// The main thread only has to walk it and push the values.
+class DecodedResult
+{
+public:
+	DecodedResult(void) : m_iRows(0), m_iColumns(0) {}
+
+	// Types come from the plan when there is one, otherwise from the field types like they always did
+	void				Decode(MYSQL_RES* result, const DecoderPlan& plan);
+
+	size_t				GetRowCount(void) const { return m_iRows; }
+	unsigned int		GetColumnCount(void) const { return m_iColumns; }
+	const std::string&	GetColumnName(unsigned int column) const { return m_columns[column]; }
+
+	const DecodedCell*	GetRow(size_t row) const { return &m_cells[row * m_iColumns]; }
+	const char*			GetString(const DecodedCell& cell) const { return m_arena.data() + cell.string.offset; }
+
+private:
+	size_t				m_iRows;
+	unsigned int		m_iColumns;
+	std::vector<std::string> m_columns;
+	std::vector<DecodedCell> m_cells;
+	std::string			m_arena;
+};
\ No newline at end of file
@@ -0,0 +1,262 @@
+#include "gm_tmysql.h"
+
+#include <cstring>
+
+// Length of the well-formed UTF-8 sequence value starts with, 0 when it doesn't start one
+static size_t UTF8SequenceLength(const unsigned char* value, size_t length)
+{
+	unsigned char c = value[0];
+	unsigned char low = 0x80, high = 0xBF;	// What the second byte may be, overlongs and surrogates excluded
+	size_t needed;
+
+	if (c >= 0xC2 && c <= 0xDF)
+		needed = 2;
+	else if (c >= 0xE0 && c <= 0xEF)
+	{
+		needed = 3;
+		if (c == 0xE0)
+			low = 0xA0;
+		else if (c == 0xED)
+			high = 0x9F;
+	}
+	else if (c >= 0xF0 && c <= 0xF4)
+	{
+		needed = 4;
+		if (c == 0xF0)
+			low = 0x90;
+		else if (c == 0xF4)
+			high = 0x8F;
+	}
+	else
+		return 0;
+
+	if (length < needed || value[1] < low || value[1] > high)
+		return 0;
+
+	for (size_t i = 2; i < needed; i++)
+	{
+		if ((value[i] & 0xC0) != 0x80)
+			return 0;
+	}
+
+	return needed;
+}
+
+static bool IsBinaryString(const MYSQL_FIELD& field)
+{
+	if (field.charsetnr != 63)
+		return false;
+
+	switch (field.type)
+	{
+	case MYSQL_TYPE_STRING:
+	case MYSQL_TYPE_VAR_STRING:
+	case MYSQL_TYPE_VARCHAR:
+	case MYSQL_TYPE_TINY_BLOB:
+	case MYSQL_TYPE_MEDIUM_BLOB:
+	case MYSQL_TYPE_LONG_BLOB:
+	case MYSQL_TYPE_BLOB:
+	case MYSQL_TYPE_BIT:
+	case MYSQL_TYPE_GEOMETRY:
+		return true;
+	default:
+		return false;
+	}
+}
+
+void AppendJSONString(std::string& out, const char* value, size_t length)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	out.push_back('"');
+
+	for (size_t i = 0; i < length; i++)
+	{
+		unsigned char c = (unsigned char)value[i];
+		switch (c)
+		{
+		case '"': out.append("\\\""); break;
+		case '\\': out.append("\\\\"); break;
+		case '\b': out.append("\\b"); break;
+		case '\f': out.append("\\f"); break;
+		case '\n': out.append("\\n"); break;
+		case '\r': out.append("\\r"); break;
+		case '\t': out.append("\\t"); break;
+		default:
+			size_t sequence = c < 0x80 ? 1 : UTF8SequenceLength((const unsigned char*)value + i, length - i);
+			if (c < 0x20 || sequence == 0)
+			{
+				out.append("\\u00");
+				out.push_back(hex[c >> 4]);
+				out.push_back(hex[c & 15]);
+			}
+			else
+			{
+				out.append(value + i, sequence);
+				i += sequence - 1;
+			}
+		}
+	}
+
+	out.push_back('"');
+}
+
+void AppendJSONBase64(std::string& out, const char* value, size_t length)
+{
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	const unsigned char* data = (const unsigned char*)value;
+
+	out.push_back('"');
+
+	for (size_t i = 0; i < length; i += 3)
+	{
+		unsigned int chunk = data[i] << 16;
+		if (i + 1 < length)
+			chunk |= data[i + 1] << 8;
+		if (i + 2 < length)
+			chunk |= data[i + 2];
+
+		out.push_back(alphabet[(chunk >> 18) & 63]);
+		out.push_back(alphabet[(chunk >> 12) & 63]);
+		out.push_back(i + 1 < length ? alphabet[(chunk >> 6) & 63] : '=');
+		out.push_back(i + 2 < length ? alphabet[chunk & 63] : '=');
+	}
+
+	out.push_back('"');
+}
+
+void AppendJSONValue(std::string& out, const char* value, size_t length, const MYSQL_FIELD& field)
+{
+	if (value == NULL)
+		out.append("null");
+	else if (IS_NUM(field.type) && field.type != MYSQL_TYPE_LONGLONG && length > 0)
+		out.append(value, length);
+	else if (IsBinaryString(field))
+		AppendJSONBase64(out, value, length);
+	else
+		AppendJSONString(out, value, length);
+}
+
+void AppendJSONRow(std::string& out, MYSQL_ROW row, unsigned long* lengths, MYSQL_FIELD* fields, unsigned int count, bool usenumbers)
+{
+	out.push_back(usenumbers ? '[' : '{');
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		if (i > 0)
+			out.push_back(',');
+
+		if (!usenumbers)
+		{
+			AppendJSONString(out, fields[i].name, fields[i].name_length);
+			out.push_back(':');
+		}
+
+		AppendJSONValue(out, row[i], lengths[i], fields[i]);
+	}
+
+	out.push_back(usenumbers ? ']' : '}');
+}
+
+void AppendJSONResults(std::string& out, Query* query)
+{
+	char number[32];
+
+	out.push_back('[');
+
+	Results results = query->GetResults();
+	for (auto iter = results.begin(); iter != results.end(); ++iter)
+	{
+		Result* result = *iter;
+
+		if (iter != results.begin())
+			out.push_back(',');
+
+		if (result->GetErrorID() != 0)
+		{
+			snprintf(number, sizeof(number), "%d", result->GetErrorID());
+			out.append("{\"status\":false,\"error\":");
+			AppendJSONString(out, result->GetError().c_str(), result->GetError().length());
+			out.append(",\"errorid\":");
+			out.append(number);
+			out.push_back('}');
+			continue;
+		}
+
+		snprintf(number, sizeof(number), "%.0f", result->GetAffected());
+		out.append("{\"status\":true,\"affected\":");
+		out.append(number);
+
+		snprintf(number, sizeof(number), "%.0f", result->GetLastID());
+		out.append(",\"lastid\":");
+		out.append(number);
+
+		out.append(",\"data\":[");
+
+		MYSQL_RES* res = result->GetResult();
+		if (res != NULL)
+		{
+			unsigned int count = mysql_num_fields(res);
+			MYSQL_FIELD* fields = mysql_fetch_fields(res);
+
+			MYSQL_ROW row;
+			for (bool first = true; (row = mysql_fetch_row(res)) != NULL; first = false)
+			{
+				if (!first)
+					out.push_back(',');
+				AppendJSONRow(out, row, mysql_fetch_lengths(res), fields, count, query->GetUseNumbers());
+			}
+		}
+
+		out.append("]}");
+	}
+
+	out.push_back(']');
+}
+
+void AppendCSVField(std::string& out, const char* value, size_t length)
+{
+	if (value == NULL)
+		return;
+
+	bool quote = false;
+	for (size_t i = 0; i < length && !quote; i++)
+		quote = value[i] == ',' || value[i] == '"' || value[i] == '\r' || value[i] == '\n';
+
+	if (!quote)
+	{
+		out.append(value, length);
+		return;
+	}
+
+	out.push_back('"');
+	for (size_t i = 0; i < length; i++)
+	{
+		if (value[i] == '"')
+			out.push_back('"');
+		out.push_back(value[i]);
+	}
+	out.push_back('"');
+}
+
+void AppendCSVHeader(std::string& out, MYSQL_FIELD* fields, unsigned int count)
+{
+	for (unsigned int i = 0; i < count; i++)
+	{
+		if (i > 0)
+			out.push_back(',');
+		AppendCSVField(out, fields[i].name, fields[i].name_length);
+	}
+	out.append("\r\n");
+}
+
+void AppendCSVRow(std::string& out, MYSQL_ROW row, unsigned long* lengths, unsigned int count)
+{
+	for (unsigned int i = 0; i < count; i++)
+	{
+		if (i > 0)
+			out.push_back(',');
+		AppendCSVField(out, row[i], lengths[i]);
+	}
+	out.append("\r\n");
+}
\ No newline at end of file
@@ -0,0 +1,20 @@
+#include <string>
+
+// Text encoders run by the workers, each appends to out. Bytes that aren't valid UTF-8 are escaped like control characters
+void AppendJSONString(std::string& out, const char* value, size_t length);
+void AppendJSONBase64(std::string& out, const char* value, size_t length);
+
+// Numeric columns are written as bare numbers, NULL as null, binary strings and blobs in base64 and everything
+// else as a string. BIGINTs are strings too, a double can't hold all of them.
+void AppendJSONValue(std::string& out, const char* value, size_t length, const MYSQL_FIELD& field);
+
+// An object keyed by column name, or an array when usenumbers is set
+void AppendJSONRow(std::string& out, MYSQL_ROW row, unsigned long* lengths, MYSQL_FIELD* fields, unsigned int count, bool usenumbers);
+
+// The results of a whole query in the same shape PopulateTableFromQuery gives Lua
+void AppendJSONResults(std::string& out, Query* query);
+
+// RFC 4180, NULL becomes an empty field. Rows end in CRLF
+void AppendCSVField(std::string& out, const char* value, size_t length);
+void AppendCSVHeader(std::string& out, MYSQL_FIELD* fields, unsigned int count);
+void AppendCSVRow(std::string& out, MYSQL_ROW row, unsigned long* lengths, unsigned int count);
\ No newline at end of file
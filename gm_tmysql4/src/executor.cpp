@@ -0,0 +1,243 @@
+#include "gm_tmysql.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+Executor sharedExecutor;
+
+Executor::Executor(void) : m_bRunning(false), m_iThreadCount(NUM_THREADS_DEFAULT)
+{
+}
+
+void Executor::Start(void)
+{
+	std::lock_guard<std::mutex> guard(m_Mutex);
+
+	if (m_bRunning)
+		return;
+
+	m_bRunning = true;
+
+	// Stopped services have to be reset before they run again, e.g. after a module reload
+	m_workService.reset();
+	m_timerService.reset();
+	m_killService.reset();
+
+	m_workGuard.reset(new asio::io_service::work(m_workService));
+	m_timerGuard.reset(new asio::io_service::work(m_timerService));
+	m_killGuard.reset(new asio::io_service::work(m_killService));
+
+	SpawnWorkers();
+
+	m_timerThread = std::thread([&]()
+	{
+		RegisterThread("tmysql:timer");
+		m_timerService.run();
+	});
+
+	m_killThread = std::thread([&]()
+	{
+		RegisterThread("tmysql:kill");
+		m_killService.run();
+	});
+}
+
+void Executor::Stop(void)
+{
+	std::lock_guard<std::mutex> guard(m_Mutex);
+
+	if (!m_bRunning)
+		return;
+
+	m_workGuard.reset();
+	m_timerGuard.reset();
+	m_killGuard.reset();
+
+	for (auto iter = m_workers.begin(); iter != m_workers.end(); ++iter)
+		iter->join();
+
+	m_workers.clear();
+	m_timerThread.join();
+	m_killThread.join();
+
+	{
+		std::lock_guard<std::mutex> options(m_OptionsMutex);
+		m_threads.clear();
+	}
+
+	m_bRunning = false;
+}
+
+void Executor::SetThreadCount(unsigned int count)
+{
+	std::lock_guard<std::mutex> guard(m_Mutex);
+
+	m_iThreadCount = count > 0 ? count : 1;
+
+	if (m_bRunning)
+		SpawnWorkers();
+}
+
+// Caller holds m_Mutex
+void Executor::SpawnWorkers(void)
+{
+	while (m_workers.size() < m_iThreadCount)
+	{
+		std::string name("tmysql:wrk:" + std::to_string(m_workers.size() + 1));
+
+		m_workers.push_back(std::thread([this, name]()
+		{
+			RegisterThread(name);
+			m_workService.run();
+		}));
+	}
+}
+
+bool Executor::SetWorkerOptions(const WorkerOptions& options, std::string& error)
+{
+	std::lock_guard<std::mutex> guard(m_OptionsMutex);
+	m_options = options;
+
+	bool success = true;
+	for (auto iter = m_threads.begin(); iter != m_threads.end(); ++iter)
+	{
+		std::string threaderror;
+		if (!ApplyWorkerOptions(*iter, threaderror) && success)
+		{
+			error.assign(threaderror);
+			success = false;
+		}
+	}
+
+	return success;
+}
+
+// Runs on the new thread itself, before it takes any work
+void Executor::RegisterThread(const std::string& name)
+{
+	ThreadInfo thread;
+	thread.name = name;
+
+#if defined(_WIN32) || defined(WIN32)
+	thread.id = GetCurrentThreadId();
+	// SetThreadDescription needs a newer SDK than we build against, Windows threads stay unnamed
+#elif defined(__linux__)
+	thread.id = (unsigned long)syscall(SYS_gettid);
+	pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+#else
+	thread.id = 0;
+#endif
+
+	std::lock_guard<std::mutex> guard(m_OptionsMutex);
+	m_threads.push_back(thread);
+
+	std::string error;
+	ApplyWorkerOptions(thread, error);
+}
+
+// Caller holds m_OptionsMutex
+bool Executor::ApplyWorkerOptions(const ThreadInfo& thread, std::string& error)
+{
+	bool success = true;
+
+#if defined(_WIN32) || defined(WIN32)
+	HANDLE handle = OpenThread(THREAD_SET_INFORMATION | THREAD_QUERY_INFORMATION, FALSE, (DWORD)thread.id);
+	if (handle == NULL)
+	{
+		error.assign("Unable to open " + thread.name);
+		return false;
+	}
+
+	if (!m_options.cpus.empty())
+	{
+		DWORD_PTR mask = 0;
+		for (auto iter = m_options.cpus.begin(); iter != m_options.cpus.end(); ++iter)
+			mask |= (DWORD_PTR)1 << *iter;
+
+		if (SetThreadAffinityMask(handle, mask) == 0)
+		{
+			error.assign("Unable to set the affinity of " + thread.name);
+			success = false;
+		}
+	}
+
+	// Windows only has priority levels, nice and the policy are mapped onto them
+	if (m_options.setnice || m_options.policy != WORKER_POLICY_DEFAULT)
+	{
+		int priority = THREAD_PRIORITY_NORMAL;
+		if (m_options.policy == WORKER_POLICY_IDLE)
+			priority = THREAD_PRIORITY_IDLE;
+		else if (m_options.nice >= 10)
+			priority = THREAD_PRIORITY_LOWEST;
+		else if (m_options.nice > 0 || m_options.policy == WORKER_POLICY_BATCH)
+			priority = THREAD_PRIORITY_BELOW_NORMAL;
+		else if (m_options.nice < 0)
+			priority = THREAD_PRIORITY_ABOVE_NORMAL;
+
+		if (!SetThreadPriority(handle, priority) && success)
+		{
+			error.assign("Unable to set the priority of " + thread.name);
+			success = false;
+		}
+	}
+
+	CloseHandle(handle);
+#elif defined(__linux__)
+	pid_t tid = (pid_t)thread.id;
+
+	if (!m_options.cpus.empty())
+	{
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		for (auto iter = m_options.cpus.begin(); iter != m_options.cpus.end(); ++iter)
+		{
+			if (*iter >= 0 && *iter < CPU_SETSIZE)
+				CPU_SET(*iter, &cpus);
+		}
+
+		if (sched_setaffinity(tid, sizeof(cpus), &cpus) != 0)
+		{
+			error.assign("Unable to set the affinity of " + thread.name + ": " + strerror(errno));
+			success = false;
+		}
+	}
+
+	if (m_options.policy != WORKER_POLICY_DEFAULT)
+	{
+		int policy = SCHED_OTHER;
+		if (m_options.policy == WORKER_POLICY_BATCH)
+			policy = SCHED_BATCH;
+		else if (m_options.policy == WORKER_POLICY_IDLE)
+			policy = SCHED_IDLE;
+
+		struct sched_param param;
+		param.sched_priority = 0;
+
+		if (sched_setscheduler(tid, policy, &param) != 0 && success)
+		{
+			error.assign("Unable to set the scheduling policy of " + thread.name + ": " + strerror(errno));
+			success = false;
+		}
+	}
+
+	// Per thread on Linux, lowering it below what the process started with needs CAP_SYS_NICE
+	if (m_options.setnice && setpriority(PRIO_PROCESS, tid, m_options.nice) != 0 && success)
+	{
+		error.assign("Unable to set the nice value of " + thread.name + ": " + strerror(errno));
+		success = false;
+	}
+#else
+	if (!m_options.cpus.empty() || m_options.setnice || m_options.policy != WORKER_POLICY_DEFAULT)
+	{
+		error.assign("Worker options aren't supported on this platform");
+		success = false;
+	}
+#endif
+
+	return success;
+}
\ No newline at end of file
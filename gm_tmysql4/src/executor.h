@@ -0,0 +1,85 @@
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+
+using namespace boost;
+
+#define NUM_THREADS_DEFAULT 4
+
+enum WorkerPolicy
+{
+	WORKER_POLICY_DEFAULT,		// Leave the scheduling class alone
+	WORKER_POLICY_OTHER,
+	WORKER_POLICY_BATCH,
+	WORKER_POLICY_IDLE,
+};
+
+// Applied to every executor thread, including ones spawned later
+struct WorkerOptions
+{
+	WorkerOptions(void) : setnice(false), nice(0), policy(WORKER_POLICY_DEFAULT) {}
+
+	std::vector<int>	cpus;		// Empty leaves the affinity alone
+	bool				setnice;
+	int					nice;
+	WorkerPolicy		policy;
+};
+
+// Worker threads shared by every Database. Each database keeps its own queue and only posts
+// as many handlers as it has connections, so idle workers take whichever database has work.
+// The timer service runs query watchdogs and other short bookkeeping on a single thread. KILLs
+// get a thread of their own, they block on the server and must not wait behind the queries they kill.
+class Executor
+{
+public:
+	Executor(void);
+
+	void				Start(void);
+	void				Stop(void);
+
+	// Growing applies immediately, shrinking on the next Start
+	void				SetThreadCount(unsigned int count);
+	unsigned int		GetThreadCount(void) { return m_iThreadCount; }
+
+	// Threads are named tmysql:wrk:<n>, tmysql:timer and tmysql:kill. Returns the first error, the rest are still applied
+	bool				SetWorkerOptions(const WorkerOptions& options, std::string& error);
+
+	asio::io_service&	GetWorkService(void) { return m_workService; }
+	asio::io_service&	GetTimerService(void) { return m_timerService; }
+	asio::io_service&	GetKillService(void) { return m_killService; }
+
+private:
+	void				SpawnWorkers(void);
+
+	struct ThreadInfo
+	{
+		std::string		name;
+		unsigned long	id;			// Kernel thread id
+	};
+
+	void				RegisterThread(const std::string& name);
+	bool				ApplyWorkerOptions(const ThreadInfo& thread, std::string& error);
+
+	std::mutex			m_OptionsMutex;
+	WorkerOptions		m_options;
+	std::vector<ThreadInfo> m_threads;
+
+	std::mutex			m_Mutex;
+	bool				m_bRunning;
+	unsigned int		m_iThreadCount;
+
+	asio::io_service	m_workService;
+	asio::io_service	m_timerService;
+	asio::io_service	m_killService;
+	std::auto_ptr<asio::io_service::work> m_workGuard;
+	std::auto_ptr<asio::io_service::work> m_timerGuard;
+	std::auto_ptr<asio::io_service::work> m_killGuard;
+
+	std::vector<std::thread> m_workers;
+	std::thread			m_timerThread;
+	std::thread			m_killThread;
+};
+
+extern Executor sharedExecutor;
\ No newline at end of file
@@ -1,26 +1,237 @@
 #include "gm_tmysql.h"
 
+#include <algorithm>
+
 using namespace GarrysMod::Lua;
 
 #define DATABASE_NAME "Database"
 #define DATABASE_ID 200
 #define RESULT_NAME "Result"
 #define RESULT_ID 201
+#define SHARDED_NAME "ShardedDatabase"
+#define SHARDED_ID 202
 
 int iRefDatabases;
 
+// Query callbacks live in one table instead of the registry. A slot takes three consecutive
+// array entries (function, object, context) and is recycled once its query is dispatched.
+enum
+{
+	CALLBACK_FUNCTION = 1,
+	CALLBACK_OBJECT,
+	CALLBACK_CONTEXT,
+	CALLBACK_SLOT_SIZE = CALLBACK_CONTEXT,
+};
+
+int iRefCallbacks;
+int iNextCallbackSlot;
+std::vector<int> vecFreeCallbackSlots;
+
 void DisconnectDB(lua_State* state, Database* mysqldb);
-void DispatchCompletedQueries(lua_State* state, Database* mysqldb);
-void HandleQueryCallback(lua_State* state, Query* query);
+void FreeDatabase(lua_State* state, Database* mysqldb);
+void DispatchCompletedQueries(lua_State* state, Database* mysqldb, std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max());
+bool HandleScanPage(lua_State* state, Database* mysqldb, Query* query, std::string& error);
+bool HandleQueryCallback(lua_State* state, Database* mysqldb, Query* query, std::string& error);
+void FreeReferences(lua_State* state, const std::vector<int>& refs);
+bool HandleQueryError(lua_State* state, Database* mysqldb, Query* query, std::string& error);
 void PopulateTableFromQuery(lua_State* state, Query* query);
+void PopulateTableFromDecoded(lua_State* state, const DecodedResult& decoded, const DecoderPlan& plan, bool usenumbers);
+int GetColumnKey(lua_State* state, const std::string& name);
 
 bool in_shutdown = false;
+double shutdown_deadline = -1;
+double dispatch_budget = 0;
+std::string file_directory("garrysmod/data/");
+int iRefErrorHandler = -1;
+int iRefCoroutineResume = -1;
+
+// Schema column names interned once as Lua strings, kept until the module closes
+std::unordered_map<std::string, int> mapColumnKeys;
+
+// Yielding can't be done through this interface, so the awaiting half is a little Lua. The coroutine
+// itself is stored in the callback slot and resumed with the results, no closure is made per query.
+const char* AWAIT_LUA =
+	"local query, shardedquery = ...\n"
+	"local running, yield = coroutine.running, coroutine.yield\n"
+	"local function current()\n"
+	"	local co = running()\n"
+	"	if not co then error(\"QueryAwait must be called from inside a coroutine, see tmysql.Run\", 3) end\n"
+	"	return co\n"
+	"end\n"
+	"local function QueryAwait(db, sql, usenumbers, options)\n"
+	"	if not query(db, sql, current(), nil, usenumbers, options) then return nil end\n"
+	"	return yield()\n"
+	"end\n"
+	"local function ShardedQueryAwait(sharded, key, sql, usenumbers, options)\n"
+	"	if not shardedquery(sharded, key, sql, current(), nil, usenumbers, options) then return nil end\n"
+	"	return yield()\n"
+	"end\n"
+	"local function Run(fn, ...)\n"
+	"	local co = coroutine.create(fn)\n"
+	"	local ok, err = coroutine.resume(co, ...)\n"
+	"	if not ok then error(err, 2) end\n"
+	"	return co\n"
+	"end\n"
+	"return QueryAwait, ShardedQueryAwait, Run\n";
+
+/*
+	CALLBACK SLOTS
+*/
+
+// Stores the values at the given stack positions, 0 leaves that field empty
+int CallbackSlotCreate(lua_State* state, int function, int object = 0, int context = 0)
+{
+	int slot;
+	if (vecFreeCallbackSlots.empty())
+		slot = iNextCallbackSlot++;
+	else
+	{
+		slot = vecFreeCallbackSlots.back();
+		vecFreeCallbackSlots.pop_back();
+	}
+
+	int top = LUA->Top();
+	int fields[CALLBACK_SLOT_SIZE] = { function, object, context };
+
+	LUA->ReferencePush(iRefCallbacks);
+	for (int i = 0; i < CALLBACK_SLOT_SIZE; i++)
+	{
+		if (fields[i] == 0)
+			continue;
+
+		LUA->PushNumber(slot * CALLBACK_SLOT_SIZE + i + 1);
+		LUA->Push(fields[i] < 0 ? top + fields[i] + 1 : fields[i]);
+		LUA->SetTable(-3);
+	}
+	LUA->Pop();
+
+	return slot;
+}
+
+void CallbackSlotPush(lua_State* state, int slot, int field)
+{
+	LUA->ReferencePush(iRefCallbacks);
+	LUA->PushNumber(slot * CALLBACK_SLOT_SIZE + field);
+	LUA->GetTable(-2);
+	LUA->Remove(-2);
+}
+
+void CallbackSlotFree(lua_State* state, int slot)
+{
+	LUA->ReferencePush(iRefCallbacks);
+	for (int i = 1; i <= CALLBACK_SLOT_SIZE; i++)
+	{
+		LUA->PushNumber(slot * CALLBACK_SLOT_SIZE + i);
+		LUA->PushNil();
+		LUA->SetTable(-3);
+	}
+	LUA->Pop();
+
+	vecFreeCallbackSlots.push_back(slot);
+}
+
+/*
+	CALLBACK GROUPS
+*/
+
+// Several queries sharing one callback. Members get a slot whose context is the group table and whose
+// object is their position, the callback gets every member's results once the last one is dispatched.
+// merge, when given, turns the array of member results into what the callback receives.
+// Leaves the group table on the stack and returns its position.
+int CallbackGroupCreate(lua_State* state, int count, int function, int object, CFunc merge)
+{
+	LUA->CreateTable();
+	{
+		LUA->Push(function);
+		LUA->SetField(-2, "callback");
+
+		if (object != 0)
+		{
+			LUA->Push(object);
+			LUA->SetField(-2, "object");
+		}
+
+		if (merge)
+		{
+			LUA->PushCFunction(merge);
+			LUA->SetField(-2, "merge");
+		}
+
+		LUA->PushNumber(count);
+		LUA->SetField(-2, "remaining");
+		LUA->CreateTable();
+		LUA->SetField(-2, "results");
+	}
+
+	return LUA->Top();
+}
+
+int CallbackGroupAddMember(lua_State* state, int group, int index)
+{
+	LUA->PushNumber(index);
+	int slot = CallbackSlotCreate(state, 0, -1, group);
+	LUA->Pop();
+
+	return slot;
+}
+
+// Expects the member's results table, the group and the member index on top of the stack, pops the last two
+bool CallbackGroupCollect(lua_State* state, std::string& error)
+{
+	int group = LUA->Top() - 1;
+
+	LUA->GetField(group, "results");
+	LUA->Push(group + 1);
+	LUA->Push(group - 1);
+	LUA->SetTable(-3);
+	LUA->Pop();
+
+	LUA->GetField(group, "remaining");
+	double remaining = LUA->GetNumber(-1) - 1;
+	LUA->Pop();
+
+	LUA->PushNumber(remaining);
+	LUA->SetField(group, "remaining");
+
+	bool success = true;
+	if (remaining <= 0)
+	{
+		LUA->GetField(group, "callback");
+
+		int args = 1;
+		LUA->GetField(group, "object");
+		if (LUA->IsType(-1, Type::NIL))
+			LUA->Pop();
+		else
+			args = 2;
+
+		LUA->GetField(group, "merge");
+		bool merge = !LUA->IsType(-1, Type::NIL);
+		if (!merge)
+			LUA->Pop();
+
+		LUA->GetField(group, "results");
+		if (merge)
+			LUA->Call(1, 1);
+
+		if (LUA->PCall(args, 0, 0) != 0)
+		{
+			error.assign(LUA->GetString(-1));
+			LUA->Pop();
+			success = false;
+		}
+	}
+
+	LUA->Pop(2);
+	return success;
+}
 
 /*
 	DATABASE META
 */
 
-int initialize(lua_State* state)
+// Returns NULL and leaves the existing database on the stack when one with this name is already connected
+Database* NewDatabase(lua_State* state)
 {
 	const char* host = LUA->CheckString(1);
 	const char* user = LUA->CheckString(2);
@@ -34,289 +245,2035 @@ int initialize(lua_State* state)
 	LUA->ReferencePush(iRefDatabases);
 	LUA->GetField(-1, db);
 
-	if (LUA->IsType(-1, DATABASE_ID))
-		return 1; // Return the already existing connection...
+	if (LUA->IsType(-1, DATABASE_ID))
+		return NULL;
+
+	LUA->Pop(2);
+
+	Database* mysqldb = new Database(host, user, pass, db, port, LUA->IsType(6, Type::STRING) ? LUA->GetString(6) : NULL, (int) LUA->GetNumber(7));
+
+	if (LUA->IsType(8, Type::TABLE))
+	{
+		LUA->GetField(8, "readtimeout");
+		LUA->GetField(8, "writetimeout");
+		mysqldb->SetNetTimeouts((unsigned int)LUA->GetNumber(-2), (unsigned int)LUA->GetNumber(-1));
+		LUA->Pop(2);
+
+		LUA->GetField(8, "timeout");
+		mysqldb->SetQueryTimeout(LUA->GetNumber(-1));
+		LUA->Pop();
+
+		LUA->GetField(8, "connections");
+		if (LUA->IsType(-1, Type::NUMBER))
+			mysqldb->SetConnectionCount((unsigned int)LUA->GetNumber(-1));
+		LUA->Pop();
+	}
+
+	return mysqldb;
+}
+
+// Registers the database and leaves its userdata on the stack
+void PushDatabase(lua_State* state, Database* mysqldb)
+{
+	UserData* userdata = (UserData*)LUA->NewUserdata(sizeof(UserData));
+	userdata->data = mysqldb;
+	userdata->type = DATABASE_ID;
+
+	int uData = LUA->ReferenceCreate();
+
+	LUA->ReferencePush(iRefDatabases);
+	LUA->ReferencePush(uData);
+	LUA->SetField(-2, mysqldb->GetDatabase());
+	LUA->Pop();
+
+	LUA->ReferencePush(uData);
+	LUA->ReferenceFree(uData);
+	LUA->CreateMetaTableType(DATABASE_NAME, DATABASE_ID);
+	LUA->SetMetaTable(-2);
+}
+
+int initialize(lua_State* state)
+{
+	Database* mysqldb = NewDatabase(state);
+
+	if (!mysqldb)
+		return 1; // Return the already existing connection...
+	
+	std::string error;
+
+	if ( !mysqldb->Initialize( error ) )
+	{
+		LUA->PushBool( false );
+		LUA->PushString(error.c_str());
+		mysqldb->Shutdown();
+		mysqldb->Release();
+		delete mysqldb;
+		return 2;
+	}
+
+	PushDatabase(state, mysqldb);
+	return 1;
+}
+
+int initializeasync(lua_State* state)
+{
+	LUA->CheckType(9, Type::FUNCTION);
+
+	Database* mysqldb = NewDatabase(state);
+
+	if (!mysqldb)
+	{
+		// Already connected, still report back through the callback
+		LUA->Push(9);
+		LUA->Push(-2);
+		LUA->PushBool(true);
+		LUA->PushString("");
+		LUA->Call(3, 0);
+		return 1;
+	}
+
+	LUA->Push(9);
+	mysqldb->SetConnectCallback(LUA->ReferenceCreate());
+	mysqldb->InitializeAsync();
+
+	// Usable straight away, queries are held until a connection is up
+	PushDatabase(state, mysqldb);
+	return 1;
+}
+
+int gettable(lua_State* state)
+{
+	LUA->ReferencePush(iRefDatabases);
+	return 1;
+}
+
+int getdatabase(lua_State* state)
+{
+	LUA->ReferencePush(iRefDatabases);
+	LUA->GetField(-1, LUA->CheckString(1));
+	return 1;
+}
+
+int escape(lua_State* state)
+{
+	LUA->CheckType(1, DATABASE_ID);
+
+	UserData* userdata = (UserData*)LUA->GetUserdata(1);
+	Database *mysqldb = (Database*)userdata->data;
+
+	if ( !mysqldb )
+		return 0;
+
+	const char* query = LUA->CheckString( 2 );
+
+	char* escaped = mysqldb->Escape( query );
+
+	if ( !escaped )
+	{
+		LUA->ThrowError( "Database is not connected yet" );
+		return 0;
+	}
+
+	LUA->PushString( escaped );
+
+	delete[] escaped;
+	return 1;
+}
+
+int disconnect(lua_State* state)
+{
+	LUA->CheckType( 1, DATABASE_ID );
+
+	UserData* userdata = (UserData*) LUA->GetUserdata(1);
+	Database *mysqldb = (Database*) userdata->data;
+
+	if (!mysqldb)
+		return 0;
+
+	LUA->ReferencePush(iRefDatabases);
+		LUA->PushNil();
+		LUA->SetField(-2, mysqldb->GetDatabase());
+	LUA->Pop();
+
+	userdata->data = NULL;
+
+	mysqldb->BeginShutdown(LUA->IsType(2, Type::NUMBER) ? LUA->GetNumber(2) : -1);
+	mysqldb->Shutdown();
+
+	// Report what never made it to the server before the callbacks get a say
+	const std::vector<std::string>& dropped = mysqldb->GetDroppedOnShutdown();
+	LUA->PushNumber((double)dropped.size());
+	LUA->CreateTable();
+	for (size_t i = 0; i < dropped.size(); i++)
+	{
+		LUA->PushNumber((double)i + 1);
+		LUA->PushString(dropped[i].c_str(), dropped[i].length());
+		LUA->SetTable(-3);
+	}
+
+	DisconnectDB( state, mysqldb );
+	return 2;
+}
+
+int setcharset(lua_State* state)
+{
+	LUA->CheckType( 1, DATABASE_ID );
+
+	UserData* userdata = (UserData*)LUA->GetUserdata(1);
+	Database *mysqldb = (Database*)userdata->data;
+
+	if ( !mysqldb )
+		return 0;
+
+	const char* set = LUA->CheckString(2);
+
+	std::string error;
+	LUA->PushBool(mysqldb->SetCharacterSet( set, error ));
+	LUA->PushString(error.c_str());
+	return 2;
+}
+
+void ReadQueryOptions(lua_State* state, int index, QueryOptions& options)
+{
+	LUA->GetField(index, "timeout");
+	if (LUA->IsType(-1, Type::NUMBER))
+		options.timeout = LUA->GetNumber(-1);
+	LUA->Pop();
+
+	LUA->GetField(index, "durable");
+	options.durable = LUA->GetBool(-1);
+	LUA->Pop();
+
+	LUA->GetField(index, "schema");
+	if (LUA->IsType(-1, Type::STRING))
+		options.schema.assign(LUA->GetString(-1));
+	LUA->Pop();
+
+	LUA->GetField(index, "format");
+	if (LUA->IsType(-1, Type::STRING) && strcmp(LUA->GetString(-1), "json") == 0)
+		options.format = FORMAT_JSON;
+	LUA->Pop();
+
+	LUA->GetField(index, "lane");
+	if (LUA->IsType(-1, Type::STRING) || LUA->IsType(-1, Type::NUMBER))
+		options.lane.assign(LUA->GetString(-1));
+	LUA->Pop();
+
+	LUA->GetField(index, "cache");
+	options.cache = LUA->GetBool(-1);
+	LUA->Pop();
+
+	LUA->GetField(index, "tables");
+	if (LUA->IsType(-1, Type::TABLE))
+	{
+		for (int i = 1;; i++)
+		{
+			LUA->PushNumber(i);
+			LUA->GetTable(-2);
+
+			if (!LUA->IsType(-1, Type::STRING))
+			{
+				LUA->Pop();
+				break;
+			}
+
+			options.tables.push_back(LUA->GetString(-1));
+			LUA->Pop();
+		}
+	}
+	LUA->Pop();
+}
+
+// QueueQuery, unless the results are in the query cache. Those reach the callback on the next dispatch
+// without touching the server.
+unsigned int QueueQueryCached(lua_State* state, Database* mysqldb, const char* query, int callback, bool usenumbers, const QueryOptions& options)
+{
+	// A hit would overtake the writes queued before it in its lane
+	if (options.cache && callback >= 0 && options.lane.empty() && Database::IsReadQuery(query))
+	{
+		int ref = mysqldb->GetQueryCache().Find(Database::GetQueryKey(query, usenumbers, options));
+		if (ref >= 0)
+		{
+			// Invalidation may free the entry's reference before this is dispatched
+			LUA->ReferencePush(ref);
+			mysqldb->QueueCachedResult(query, callback, usenumbers, LUA->ReferenceCreate());
+			return 0;
+		}
+	}
+
+	return mysqldb->QueueQuery(query, callback, usenumbers, options);
+}
+
+// "file:line" of the function at the given stack position, or of the Lua caller when 0
+std::string GetLuaSource(lua_State* state, int function)
+{
+	LUA->PushSpecial(GarrysMod::Lua::SPECIAL_GLOB);
+	LUA->GetField(-1, "debug");
+	LUA->GetField(-1, "getinfo");
+
+	if (function != 0)
+		LUA->Push(function);
+	else
+		LUA->PushNumber(2);
+
+	LUA->PushString("Sl");
+	LUA->Call(2, 1);
+
+	std::string source;
+	if (LUA->IsType(-1, Type::TABLE))
+	{
+		LUA->GetField(-1, "short_src");
+		LUA->GetField(-2, function != 0 ? "linedefined" : "currentline");
+
+		char line[16];
+		snprintf(line, sizeof(line), ":%d", (int)LUA->GetNumber(-1));
+		source.assign(LUA->GetString(-2) ? LUA->GetString(-2) : "?");
+		source.append(line);
+		LUA->Pop(2);
+	}
+
+	LUA->Pop(3);
+	return source;
+}
+
+int query(lua_State* state)
+{
+	LUA->CheckType(1, DATABASE_ID);
+
+	UserData* userdata = (UserData*)LUA->GetUserdata(1);
+	Database *mysqldb = (Database*)userdata->data;
+
+	if ( !mysqldb )
+		return 0;
+
+	LUA->CheckString(2);
+
+	unsigned int querylen;
+	const char* query = LUA->GetString(2, &querylen);
+
+	// Give Lua a chance to react before the database applies its backpressure policy
+	if (mysqldb->IsOverQueueLimits(querylen))
+	{
+		LUA->PushSpecial(GarrysMod::Lua::SPECIAL_GLOB);
+		LUA->GetField(-1, "hook");
+		LUA->GetField(-1, "Run");
+		LUA->PushString("OnBackpressure");
+		LUA->Push(1);
+		LUA->PushNumber(mysqldb->GetInFlightCount());
+		LUA->PushNumber((double)mysqldb->GetQueuedBytes());
+
+		if (LUA->PCall(4, 0, 0) != 0)
+		{
+			std::string error(LUA->GetString(-1));
+			LUA->Pop(3);
+			LUA->ThrowError(error.c_str());
+		}
+		LUA->Pop(2);
+
+		// A hook is free to disconnect the database
+		mysqldb = (Database*)userdata->data;
+		if (!mysqldb)
+			return 0;
+	}
+
+	// A coroutine in place of the callback is QueryAwait's
+	int callback = -1;
+	if (LUA->GetType(3) == Type::FUNCTION)
+		callback = CallbackSlotCreate(state, 3, LUA->GetType(4) != Type::NIL ? 4 : 0);
+	else if (LUA->GetType(3) == Type::THREAD)
+		callback = CallbackSlotCreate(state, 0, 0, 3);
+
+	QueryOptions options;
+	if (LUA->IsType(6, Type::TABLE))
+		ReadQueryOptions(state, 6, options);
+
+	if (mysqldb->IsSlowQueryLogEnabled())
+		options.source = GetLuaSource(state, LUA->GetType(3) == Type::FUNCTION ? 3 : 0);
+
+	LUA->PushNumber(QueueQueryCached(state, mysqldb, query, callback, LUA->GetBool(5), options));
+	return 1;
+}
+
+bool IsAbsolutePath(const std::string& path)
+{
+	return !path.empty() && (path[0] == '/' || path[0] == '\\' || (path.length() > 1 && path[1] == ':'));
+}
+
+bool HasParentReference(const std::string& path)
+{
+	for (size_t start = 0; start <= path.length(); )
+	{
+		size_t end = path.find_first_of("/\\", start);
+		if (end == std::string::npos)
+			end = path.length();
+
+		if (path.compare(start, end - start, "..") == 0)
+			return true;
+
+		start = end + 1;
+	}
+
+	return false;
+}
+
+// Paths Lua hands us are relative to file_directory, like the file library's DATA. Raises an argument error
+// for absolute paths and any that climb out with "..".
+std::string ResolveFilePath(lua_State* state, int index)
+{
+	std::string path(LUA->CheckString(index));
+
+	if (path.empty() || IsAbsolutePath(path))
+		LUA->ArgError(index, "path must be relative to the data directory");
+
+	if (HasParentReference(path))
+		LUA->ArgError(index, "path must not contain \"..\"");
+
+	return file_directory + path;
+}
+
+// db:ExportQuery(sql, path, "csv" or "ndjson", callback, object, options). The rows never reach Lua,
+// the callback's results carry rows and bytes in place of data.
+int exportquery(lua_State* state)
+{
+	LUA->CheckType(1, DATABASE_ID);
+
+	UserData* userdata = (UserData*)LUA->GetUserdata(1);
+	Database *mysqldb = (Database*)userdata->data;
+
+	if (!mysqldb)
+		return 0;
+
+	const char* query = LUA->CheckString(2);
+	std::string path(ResolveFilePath(state, 3));
+
+	QueryFormat format = FORMAT_CSV;
+	std::string name(LUA->CheckString(4));
+	if (name == "ndjson")
+		format = FORMAT_NDJSON;
+	else if (name != "csv")
+		LUA->ArgError(4, "format must be \"csv\" or \"ndjson\"");
+
+	int callback = -1;
+	if (LUA->GetType(5) == Type::FUNCTION)
+		callback = CallbackSlotCreate(state, 5, LUA->GetType(6) != Type::NIL ? 6 : 0);
+
+	QueryOptions options;
+	if (LUA->IsType(7, Type::TABLE))
+		ReadQueryOptions(state, 7, options);
+
+	if (mysqldb->IsSlowQueryLogEnabled())
+		options.source = GetLuaSource(state, callback >= 0 ? 5 : 0);
+
+	LUA->PushNumber(mysqldb->QueueExport(query, path.c_str(), format, callback, options));
+	return 1;
+}
+
+// db:WriteBlob(table, { keycolumn = value, ... }, column, path, callback, object, options). Inserts or updates
+// the row with those keys, the file is streamed into column without ever becoming a Lua string.
+int writeblob(lua_State* state)
+{
+	LUA->CheckType(1, DATABASE_ID);
+	LUA->CheckType(3, Type::TABLE);
+
+	UserData* userdata = (UserData*)LUA->GetUserdata(1);
+	Database *mysqldb = (Database*)userdata->data;
+
+	if (!mysqldb)
+		return 0;
+
+	const char* table = LUA->CheckString(2);
+	const char* column = LUA->CheckString(4);
+	std::string path(ResolveFilePath(state, 5));
+
+	std::vector<std::pair<std::string, std::string> > keys;
+
+	LUA->PushNil();
+	while (LUA->Next(3))
+	{
+		if (!LUA->IsType(-2, Type::STRING) || !(LUA->IsType(-1, Type::STRING) || LUA->IsType(-1, Type::NUMBER)))
+			LUA->ArgError(3, "expected keycolumn = string or number");
+
+		keys.push_back(std::make_pair(std::string(LUA->GetString(-2)), std::string(LUA->GetString(-1))));
+		LUA->Pop();
+	}
+
+	if (keys.empty())
+		LUA->ArgError(3, "expected at least one key column");
+
+	int callback = -1;
+	if (LUA->GetType(6) == Type::FUNCTION)
+		callback = CallbackSlotCreate(state, 6, LUA->GetType(7) != Type::NIL ? 7 : 0);
+
+	QueryOptions options;
+	if (LUA->IsType(8, Type::TABLE))
+		ReadQueryOptions(state, 8, options);
+
+	if (mysqldb->IsSlowQueryLogEnabled())
+		options.source = GetLuaSource(state, callback >= 0 ? 6 : 0);
+
+	LUA->PushNumber(mysqldb->QueueBlobWrite(table, keys, column, path.c_str(), callback, options));
+	return 1;
+}
+
+// db:ReadBlobToFile(sql, path, callback, object, options). The first column of the first row is written to path,
+// the callback's results carry rows (0 or 1) and bytes in place of data.
+int readblobtofile(lua_State* state)
+{
+	LUA->CheckType(1, DATABASE_ID);
+
+	UserData* userdata = (UserData*)LUA->GetUserdata(1);
+	Database *mysqldb = (Database*)userdata->data;
+
+	if (!mysqldb)
+		return 0;
+
+	const char* query = LUA->CheckString(2);
+	std::string path(ResolveFilePath(state, 3));
+
+	int callback = -1;
+	if (LUA->GetType(4) == Type::FUNCTION)
+		callback = CallbackSlotCreate(state, 4, LUA->GetType(5) != Type::NIL ? 5 : 0);
+
+	QueryOptions options;
+	if (LUA->IsType(6, Type::TABLE))
+		ReadQueryOptions(state, 6, options);
+
+	if (mysqldb->IsSlowQueryLogEnabled())
+		options.source = GetLuaSource(state, callback >= 0 ? 4 : 0);
+
+	LUA->PushNumber(mysqldb->QueueExport(query, path.c_str(), FORMAT_BLOB, callback, options));
+	return 1;
+}
+
+// Queues every statement on its own so they spread over the pool, the callback gets their results in order.
+// An empty batch queues nothing and calls back right away with no results.
+int querybatch(lua_State* state)
+{
+	LUA->CheckType(1, DATABASE_ID);
+	LUA->CheckType(2, Type::TABLE);
+
+	UserData* userdata = (UserData*)LUA->GetUserdata(1);
+	Database *mysqldb = (Database*)userdata->data;
+
+	if (!mysqldb)
+		return 0;
+
+	std::vector<std::string> queries;
+	for (int i = 1;; i++)
+	{
+		LUA->PushNumber(i);
+		LUA->GetTable(2);
+
+		if (!LUA->IsType(-1, Type::STRING))
+		{
+			LUA->Pop();
+			break;
+		}
+
+		queries.push_back(LUA->GetString(-1));
+		LUA->Pop();
+	}
+
+	bool usenumbers = LUA->GetBool(5);
+
+	QueryOptions options;
+	if (LUA->IsType(6, Type::TABLE))
+		ReadQueryOptions(state, 6, options);
+
+	if (queries.empty())
+	{
+		if (LUA->GetType(3) == Type::FUNCTION)
+		{
+			int args = 1;
+			LUA->Push(3);
+			if (LUA->GetType(4) != Type::NIL)
+			{
+				LUA->Push(4);
+				args = 2;
+			}
+			LUA->CreateTable();
+			LUA->Call(args, 0);
+		}
+
+		LUA->PushNumber(0);
+		return 1;
+	}
+
+	int group = 0;
+	if (LUA->GetType(3) == Type::FUNCTION)
+		group = CallbackGroupCreate(state, (int)queries.size(), 3, LUA->GetType(4) != Type::NIL ? 4 : 0, NULL);
+
+	if (mysqldb->IsSlowQueryLogEnabled())
+		options.source = GetLuaSource(state, group != 0 ? 3 : 0);
+
+	for (size_t i = 0; i < queries.size(); i++)
+	{
+		int callback = -1;
+		if (group != 0)
+			callback = CallbackGroupAddMember(state, group, (int)i + 1);
+
+		QueueQueryCached(state, mysqldb, queries[i].c_str(), callback, usenumbers, options);
+	}
+
+	if (group != 0)
+		LUA->Pop();
+
+	LUA->PushNumber((double)queries.size());
+	return 1;
+}
+
+// db:RegisterSchema(name, { column = "int" | "number" | "string" | "bool", ... })
+int registerschema(lua_State* state)
+{
+	LUA->CheckType(1, DATABASE_ID);
+	LUA->CheckType(3, Type::TABLE);
+
+	UserData* userdata = (UserData*)LUA->GetUserdata(1);
+	Database *mysqldb = (Database*)userdata->data;
+
+	if (!mysqldb)
+		return 0;
+
+	std::shared_ptr<ResultSchema> schema = std::make_shared<ResultSchema>(LUA->CheckString(2));
+
+	LUA->PushNil();
+	while (LUA->Next(3))
+	{
+		SchemaType type;
+		if (!LUA->IsType(-2, Type::STRING) || !LUA->IsType(-1, Type::STRING) || !ResultSchema::ParseType(LUA->GetString(-1), type))
+			LUA->ArgError(3, "expected column = \"int\", \"number\", \"string\" or \"bool\"");
+
+		std::string name(LUA->GetString(-2));
+		schema->AddColumn(name, type, GetColumnKey(state, name));
+
+		LUA->Pop();
+	}
+
+	mysqldb->RegisterSchema(schema);
+	return 0;
+}
+
+int setqueuelimits(lua_State* state)
+{
+	LUA->CheckType(1, DATABASE_ID);
+
+	UserData* userdata = (UserData*)LUA->GetUserdata(1);
+	Database *mysqldb = (Database*)userdata->data;
+
+	if (!mysqldb)
+		return 0;
+
+	mysqldb->SetQueueLimits((unsigned int)LUA->GetNumber(2), (size_t)LUA->GetNumber(3), (BackpressurePolicy)(int)LUA->GetNumber(4));
+	return 0;
+}
+
+int setcoalescereads(lua_State* state)
+{
+	LUA->CheckType(1, DATABASE_ID);
+
+	UserData* userdata = (UserData*)LUA->GetUserdata(1);
+	Database *mysqldb = (Database*)userdata->data;
+
+	if (!mysqldb)
+		return 0;
+
+	mysqldb->SetCoalesceReads(LUA->GetBool(2));
+	return 0;
+}
+
+int setwritebehind(lua_State* state)
+{
+	LUA->CheckType(1, DATABASE_ID);
+
+	UserData* userdata = (UserData*)LUA->GetUserdata(1);
+	Database *mysqldb = (Database*)userdata->data;
+
+	if (!mysqldb)
+		return 0;
+
+	if (!LUA->IsType(2, Type::TABLE))
+	{
+		mysqldb->SetWriteBehind(LUA->GetBool(2), 100, 65536, 1);
+		return 0;
+	}
+
+	unsigned int maxstatements = 100;
+	size_t maxbytes = 65536;
+	double interval = 1;
+
+	LUA->GetField(2, "maxstatements");
+	if (LUA->IsType(-1, Type::NUMBER))
+		maxstatements = (unsigned int)LUA->GetNumber(-1);
+	LUA->Pop();
+
+	LUA->GetField(2, "maxbytes");
+	if (LUA->IsType(-1, Type::NUMBER))
+		maxbytes = (size_t)LUA->GetNumber(-1);
+	LUA->Pop();
+
+	LUA->GetField(2, "interval");
+	if (LUA->IsType(-1, Type::NUMBER))
+		interval = LUA->GetNumber(-1);
+	LUA->Pop();
+
+	mysqldb->SetWriteBehind(true, maxstatements, maxbytes, interval);
+	return 0;
+}
+
+int upsertcoalesced(lua_State* state)
+{
+	LUA->CheckType(1, DATABASE_ID);
+
+	UserData* userdata = (UserData*)LUA->GetUserdata(1);
+	Database *mysqldb = (Database*)userdata->data;
+
+	if (!mysqldb)
+		return 0;
+
+	mysqldb->UpsertCoalesced(LUA->CheckString(2), LUA->CheckString(3));
+	return 0;
+}
+
+int setupsertinterval(lua_State* state)
+{
+	LUA->CheckType(1, DATABASE_ID);
+
+	UserData* userdata = (UserData*)LUA->GetUserdata(1);
+	Database *mysqldb = (Database*)userdata->data;
+
+	if (!mysqldb)
+		return 0;
+
+	mysqldb->SetUpsertInterval(LUA->CheckNumber(2));
+	return 0;
+}
+
+int flushcoalesced(lua_State* state)
+{
+	LUA->CheckType(1, DATABASE_ID);
+
+	UserData* userdata = (UserData*)LUA->GetUserdata(1);
+	Database *mysqldb = (Database*)userdata->data;
+
+	if (!mysqldb)
+		return 0;
+
+	mysqldb->FlushCoalesced(true);
+	return 0;
+}
+
+// db:EnableBinlogInvalidation(serverid). Cached results are dropped as soon as a table they're tagged with
+// changes on the server. serverid must not be used by any other replica of the server. Returns false and
+// why when the client library can't follow the binary log.
+int enablebinloginvalidation(lua_State* state)
+{
+	LUA->CheckType(1, DATABASE_ID);
+
+	UserData* userdata = (UserData*)LUA->GetUserdata(1);
+	Database *mysqldb = (Database*)userdata->data;
+
+	if (!mysqldb)
+		return 0;
+
+	std::string error;
+	if (mysqldb->EnableBinlogInvalidation((unsigned int)LUA->CheckNumber(2), error))
+	{
+		LUA->PushBool(true);
+		return 1;
+	}
+
+	LUA->PushBool(false);
+	LUA->PushString(error.c_str());
+	return 2;
+}
+
+// db:InvalidateCache(table), for changes the binary log doesn't see or when it isn't followed
+int invalidatecache(lua_State* state)
+{
+	LUA->CheckType(1, DATABASE_ID);
+
+	UserData* userdata = (UserData*)LUA->GetUserdata(1);
+	Database *mysqldb = (Database*)userdata->data;
+
+	if (!mysqldb)
+		return 0;
+
+	std::vector<int> freed;
+	mysqldb->InvalidateCache(LUA->CheckString(2), freed);
+	FreeReferences(state, freed);
+
+	LUA->PushNumber((double)freed.size());
+	return 1;
+}
+
+int clearcache(lua_State* state)
+{
+	LUA->CheckType(1, DATABASE_ID);
+
+	UserData* userdata = (UserData*)LUA->GetUserdata(1);
+	Database *mysqldb = (Database*)userdata->data;
+
+	if (!mysqldb)
+		return 0;
+
+	std::vector<int> freed;
+	mysqldb->InvalidateCache("", freed);
+	FreeReferences(state, freed);
+	return 0;
+}
+
+int getstats(lua_State* state)
+{
+	LUA->CheckType(1, DATABASE_ID);
+
+	UserData* userdata = (UserData*)LUA->GetUserdata(1);
+	Database *mysqldb = (Database*)userdata->data;
+
+	if (!mysqldb)
+		return 0;
+
+	LUA->CreateTable();
+	LUA->PushNumber(mysqldb->GetInFlightCount());
+	LUA->SetField(-2, "inflight");
+	LUA->PushNumber((double)mysqldb->GetQueuedBytes());
+	LUA->SetField(-2, "queuedbytes");
+	LUA->PushNumber(mysqldb->GetRejectedCount());
+	LUA->SetField(-2, "rejected");
+	LUA->PushNumber(mysqldb->GetDroppedCount());
+	LUA->SetField(-2, "dropped");
+	LUA->PushNumber(mysqldb->GetCoalescedCount());
+	LUA->SetField(-2, "coalesced");
+	LUA->PushNumber((double)mysqldb->GetWriteBehindCount());
+	LUA->SetField(-2, "writesbuffered");
+	LUA->PushNumber(mysqldb->GetWriteBehindFlushed());
+	LUA->SetField(-2, "writesflushed");
+	LUA->PushNumber(mysqldb->GetWriteBehindBatches());
+	LUA->SetField(-2, "writebatches");
+	LUA->PushNumber((double)mysqldb->GetUpsertPendingCount());
+	LUA->SetField(-2, "upsertspending");
+	LUA->PushNumber(mysqldb->GetUpsertSavedCount());
+	LUA->SetField(-2, "upsertssaved");
+	LUA->PushNumber((double)mysqldb->GetQueryCache().GetSize());
+	LUA->SetField(-2, "cacheentries");
+	LUA->PushNumber(mysqldb->GetQueryCache().GetHits());
+	LUA->SetField(-2, "cachehits");
+	return 1;
+}
+
+int setslowquerylog(lua_State* state)
+{
+	LUA->CheckType(1, DATABASE_ID);
+
+	UserData* userdata = (UserData*)LUA->GetUserdata(1);
+	Database *mysqldb = (Database*)userdata->data;
+
+	if (!mysqldb)
+		return 0;
+
+	mysqldb->SetSlowQueryLog(LUA->CheckNumber(2), LUA->IsType(3, Type::STRING) ? LUA->GetString(3) : NULL);
+	mysqldb->SetExplainSlowQueries(LUA->GetBool(4));
+	return 0;
+}
+
+int getslowqueries(lua_State* state)
+{
+	LUA->CheckType(1, DATABASE_ID);
+
+	UserData* userdata = (UserData*)LUA->GetUserdata(1);
+	Database *mysqldb = (Database*)userdata->data;
+
+	if (!mysqldb)
+		return 0;
+
+	std::vector<SlowQueryEntry> entries;
+	mysqldb->GetSlowQueries(entries);
+
+	LUA->CreateTable();
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		const SlowQueryEntry& entry = entries[i];
+
+		LUA->PushNumber((double)i + 1);
+		LUA->CreateTable();
+		{
+			LUA->PushString(entry.query);
+			LUA->SetField(-2, "query");
+			LUA->PushString(entry.source);
+			LUA->SetField(-2, "source");
+			LUA->PushNumber((double)entry.when);
+			LUA->SetField(-2, "time");
+			LUA->PushNumber(entry.queuetime);
+			LUA->SetField(-2, "queuetime");
+			LUA->PushNumber(entry.exectime);
+			LUA->SetField(-2, "exectime");
+			LUA->PushNumber(entry.fetchtime);
+			LUA->SetField(-2, "fetchtime");
+			LUA->PushNumber(entry.rows);
+			LUA->SetField(-2, "rows");
+			LUA->PushNumber(entry.bytes);
+			LUA->SetField(-2, "bytes");
+			LUA->PushNumber(entry.errorid);
+			LUA->SetField(-2, "errorid");
+
+			if (entry.explained)
+			{
+				LUA->CreateTable();
+				LUA->PushString(entry.access);
+				LUA->SetField(-2, "access");
+				LUA->PushString(entry.key);
+				LUA->SetField(-2, "key");
+				LUA->PushNumber(entry.examined);
+				LUA->SetField(-2, "examined");
+				LUA->PushBool(entry.filesort);
+				LUA->SetField(-2, "filesort");
+				LUA->PushBool(entry.temporary);
+				LUA->SetField(-2, "temporary");
+				LUA->PushBool(entry.fullscan);
+				LUA->SetField(-2, "fullscan");
+				LUA->SetField(-2, "plan");
+			}
+		}
+		LUA->SetTable(-3);
+	}
+	return 1;
+}
+
+int cancel(lua_State* state)
+{
+	LUA->CheckType(1, DATABASE_ID);
+
+	UserData* userdata = (UserData*)LUA->GetUserdata(1);
+	Database *mysqldb = (Database*)userdata->data;
+
+	if (!mysqldb)
+		return 0;
+
+	LUA->PushBool(mysqldb->CancelQuery((unsigned int)LUA->CheckNumber(2)));
+	return 1;
+}
+
+// Seconds from now the dispatch budget allows, or no deadline at all
+std::chrono::steady_clock::time_point GetDispatchDeadline(void)
+{
+	if (dispatch_budget <= 0)
+		return std::chrono::steady_clock::time_point::max();
+
+	return std::chrono::steady_clock::now() + std::chrono::microseconds((long long)(dispatch_budget * 1000000));
+}
+
+int poll(lua_State* state)
+{
+	LUA->CheckType(1, DATABASE_ID);
+
+	UserData* userdata = (UserData*)LUA->GetUserdata(1);
+	Database *mysqldb = (Database*)userdata->data;
+
+	if (!mysqldb)
+		return 0;
+
+	DispatchCompletedQueries(state, mysqldb, GetDispatchDeadline());
+	return 0;
+}
+
+// db:Scan(table, keycolumn, { batch = 1000, where = sql, prefetch = 1, usenumbers = false, timeout = s }, onBatch, onDone).
+// onBatch(rows) gets every page in key order and may return false to stop early, onDone(success, rows, error)
+// follows the last one. The key has to be unique and never NULL. where is plain SQL and isn't escaped.
+int scan(lua_State* state)
+{
+	LUA->CheckType(1, DATABASE_ID);
+	LUA->CheckType(5, Type::FUNCTION);
+
+	UserData* userdata = (UserData*)LUA->GetUserdata(1);
+	Database *mysqldb = (Database*)userdata->data;
+
+	if (!mysqldb)
+		return 0;
+
+	const char* table = LUA->CheckString(2);
+	const char* key = LUA->CheckString(3);
+
+	unsigned int batch = 1000;
+	unsigned int prefetch = 1;
+	bool usenumbers = false;
+	std::string where;
+
+	QueryOptions options;
+	if (LUA->IsType(4, Type::TABLE))
+	{
+		ReadQueryOptions(state, 4, options);
+
+		LUA->GetField(4, "batch");
+		if (LUA->IsType(-1, Type::NUMBER) && LUA->GetNumber(-1) >= 1)
+			batch = (unsigned int)LUA->GetNumber(-1);
+		LUA->Pop();
+
+		LUA->GetField(4, "prefetch");
+		if (LUA->IsType(-1, Type::NUMBER) && LUA->GetNumber(-1) >= 0)
+			prefetch = (unsigned int)LUA->GetNumber(-1);
+		LUA->Pop();
+
+		LUA->GetField(4, "where");
+		if (LUA->IsType(-1, Type::STRING))
+			where.assign(LUA->GetString(-1));
+		LUA->Pop();
+
+		LUA->GetField(4, "usenumbers");
+		usenumbers = LUA->GetBool(-1);
+		LUA->Pop();
+	}
+
+	if (mysqldb->IsSlowQueryLogEnabled())
+		options.source = GetLuaSource(state, 5);
+
+	std::shared_ptr<TableScan> tablescan = std::make_shared<TableScan>(table, key, where, batch, prefetch);
+	tablescan->SetUseNumbers(usenumbers);
+	tablescan->SetOptions(options);
+
+	if (!mysqldb->QueueScanPage(tablescan))
+		return 0;
+
+	// Held by the scan until onDone has run
+	LUA->Push(5);
+	int batchcallback = LUA->ReferenceCreate();
+	int donecallback = -1;
+	if (LUA->IsType(6, Type::FUNCTION))
+	{
+		LUA->Push(6);
+		donecallback = LUA->ReferenceCreate();
+	}
+	tablescan->SetCallbacks(batchcallback, donecallback);
+
+	LUA->PushBool(true);
+	return 1;
+}
+
+/*
+	SHARDED DATABASE META
+*/
+
+int shardeddatabase(lua_State* state)
+{
+	LUA->CheckType(1, Type::TABLE);
+
+	ShardHash hash = SHARD_HASH_JUMP;
+	if (LUA->IsType(2, Type::TABLE))
+	{
+		LUA->GetField(2, "hash");
+		if (LUA->IsType(-1, Type::STRING))
+		{
+			std::string name(LUA->GetString(-1));
+			if (name == "modulo")
+				hash = SHARD_HASH_MODULO;
+			else if (name != "jump")
+				LUA->ArgError(2, "hash must be \"jump\" or \"modulo\"");
+		}
+		LUA->Pop();
+	}
+
+	// Our own copy, so changes to the caller's table can't reshuffle keys
+	LUA->CreateTable();
+
+	int shards = 0;
+	while (true)
+	{
+		LUA->PushNumber(shards + 1);
+		LUA->GetTable(1);
+
+		if (LUA->IsType(-1, Type::NIL))
+		{
+			LUA->Pop();
+			break;
+		}
+
+		if (!LUA->IsType(-1, DATABASE_ID))
+			LUA->ArgError(1, "expected a list of databases");
+
+		LUA->PushNumber(++shards);
+		LUA->Insert(-2);
+		LUA->SetTable(-3);
+	}
+
+	if (shards == 0)
+		LUA->ArgError(1, "expected at least one database");
+
+	int databases = LUA->ReferenceCreate();
+
+	UserData* userdata = (UserData*)LUA->NewUserdata(sizeof(UserData));
+	userdata->data = new ShardedDatabase(databases, shards, hash);
+	userdata->type = SHARDED_ID;
+
+	LUA->CreateMetaTableType(SHARDED_NAME, SHARDED_ID);
+	LUA->SetMetaTable(-2);
+	return 1;
+}
+
+int shardedgc(lua_State* state)
+{
+	LUA->CheckType(1, SHARDED_ID);
+
+	UserData* userdata = (UserData*)LUA->GetUserdata(1);
+	ShardedDatabase* sharded = (ShardedDatabase*)userdata->data;
+
+	if (!sharded)
+		return 0;
+
+	LUA->ReferenceFree(sharded->GetDatabases());
+	userdata->data = NULL;
+	delete sharded;
+	return 0;
+}
+
+void PushShardDatabase(lua_State* state, ShardedDatabase* sharded, int shard)
+{
+	LUA->ReferencePush(sharded->GetDatabases());
+	LUA->PushNumber(shard + 1);
+	LUA->GetTable(-2);
+	LUA->Remove(-2);
+}
+
+int shardedgetshard(lua_State* state)
+{
+	LUA->CheckType(1, SHARDED_ID);
+
+	UserData* userdata = (UserData*)LUA->GetUserdata(1);
+	ShardedDatabase* sharded = (ShardedDatabase*)userdata->data;
+
+	if (!sharded)
+		return 0;
+
+	int shard = sharded->GetShard(LUA->CheckString(2));
+
+	PushShardDatabase(state, sharded, shard);
+	LUA->PushNumber(shard + 1);
+	return 2;
+}
+
+// Keys go through tostring, pass 64 bit ids such as SteamID64s as strings
+int shardedquery(lua_State* state)
+{
+	LUA->CheckType(1, SHARDED_ID);
+
+	UserData* userdata = (UserData*)LUA->GetUserdata(1);
+	ShardedDatabase* sharded = (ShardedDatabase*)userdata->data;
+
+	if (!sharded)
+		return 0;
+
+	PushShardDatabase(state, sharded, sharded->GetShard(LUA->CheckString(2)));
+
+	// Becomes db:Query(sql, ...) on the chosen shard
+	LUA->Insert(1);
+	LUA->Remove(3);
+	LUA->Remove(2);
+
+	return query(state);
+}
+
+// Folds the per shard results into one results table, rows are appended in shard order.
+// A statement's status, error and errorid come from the first shard it failed on.
+int mergeshardresults(lua_State* state)
+{
+	LUA->CreateTable();
+
+	std::vector<int> rowcounts;
+
+	for (int shard = 1;; shard++)
+	{
+		LUA->PushNumber(shard);
+		LUA->GetTable(1);
+
+		if (!LUA->IsType(3, Type::TABLE))
+		{
+			LUA->Pop();
+			break;
+		}
+
+		for (int index = 1;; index++)
+		{
+			LUA->PushNumber(index);
+			LUA->GetTable(3);
+
+			if (!LUA->IsType(4, Type::TABLE))
+			{
+				LUA->Pop();
+				break;
+			}
+
+			LUA->PushNumber(index);
+			LUA->GetTable(2);
+
+			if (!LUA->IsType(5, Type::TABLE))
+			{
+				LUA->Pop();
+
+				LUA->CreateTable();
+				LUA->PushBool(true);
+				LUA->SetField(-2, "status");
+				LUA->PushNumber(0);
+				LUA->SetField(-2, "affected");
+				LUA->CreateTable();
+				LUA->SetField(-2, "data");
+
+				LUA->PushNumber(index);
+				LUA->Push(-2);
+				LUA->SetTable(2);
+
+				rowcounts.push_back(0);
+			}
+
+			LUA->GetField(4, "status");
+			LUA->GetField(5, "status");
+			if (!LUA->GetBool(-2) && LUA->GetBool(-1))
+			{
+				LUA->PushBool(false);
+				LUA->SetField(5, "status");
+				LUA->GetField(4, "error");
+				LUA->SetField(5, "error");
+				LUA->GetField(4, "errorid");
+				LUA->SetField(5, "errorid");
+			}
+			LUA->Pop(2);
+
+			LUA->GetField(4, "affected");
+			LUA->GetField(5, "affected");
+			double affected = LUA->GetNumber(-2) + LUA->GetNumber(-1);
+			LUA->Pop(2);
+			LUA->PushNumber(affected);
+			LUA->SetField(5, "affected");
+
+			LUA->GetField(4, "data");
+			LUA->GetField(5, "data");
+			if (LUA->IsType(6, Type::TABLE))
+			{
+				for (int row = 1;; row++)
+				{
+					LUA->PushNumber(rowcounts[index - 1] + 1);
+					LUA->PushNumber(row);
+					LUA->GetTable(6);
+
+					if (LUA->IsType(-1, Type::NIL))
+					{
+						LUA->Pop(2);
+						break;
+					}
+
+					LUA->SetTable(7);
+					rowcounts[index - 1]++;
+				}
+			}
+
+			LUA->Pop(LUA->Top() - 3);
+		}
+
+		LUA->Pop();
+	}
+
+	LUA->Push(1);
+	LUA->SetField(2, "shards");
+	return 1;
+}
+
+// Runs the query on every shard, the callback gets the merged results once all of them are in. Merging
+// works on tables, format = "json" isn't supported here.
+int shardedqueryall(lua_State* state)
+{
+	LUA->CheckType(1, SHARDED_ID);
+
+	UserData* userdata = (UserData*)LUA->GetUserdata(1);
+	ShardedDatabase* sharded = (ShardedDatabase*)userdata->data;
+
+	if (!sharded)
+		return 0;
+
+	const char* query = LUA->CheckString(2);
+	bool usenumbers = LUA->GetBool(5);
+
+	QueryOptions options;
+	if (LUA->IsType(6, Type::TABLE))
+		ReadQueryOptions(state, 6, options);
+
+	if (options.format == FORMAT_JSON)
+		LUA->ArgError(6, "QueryAll can't merge format = \"json\" results");
+
+	// Fail before anything is queued rather than leave the callback waiting on a shard that never answers
+	std::vector<Database*> databases;
+	for (int i = 0; i < sharded->GetShardCount(); i++)
+	{
+		PushShardDatabase(state, sharded, i);
+		Database* mysqldb = (Database*)((UserData*)LUA->GetUserdata(-1))->data;
+		LUA->Pop();
+
+		if (!mysqldb)
+			LUA->ThrowError("ShardedDatabase has a disconnected shard");
+
+		databases.push_back(mysqldb);
+	}
+
+	int group = 0;
+	if (LUA->GetType(3) == Type::FUNCTION)
+		group = CallbackGroupCreate(state, (int)databases.size(), 3, LUA->GetType(4) != Type::NIL ? 4 : 0, mergeshardresults);
+
+	for (size_t i = 0; i < databases.size(); i++)
+	{
+		int callback = -1;
+		if (group != 0)
+			callback = CallbackGroupAddMember(state, group, (int)i + 1);
+
+		if (databases[i]->IsSlowQueryLogEnabled() && options.source.empty())
+			options.source = GetLuaSource(state, group != 0 ? 3 : 0);
+
+		QueueQueryCached(state, databases[i], query, callback, usenumbers, options);
+	}
+
+	if (group != 0)
+		LUA->Pop();
+
+	return 0;
+}
+
+/*
+	TMYSQL STUFFS
+*/
+
+int pollall(lua_State* state)
+{
+	if (!completionWakeup.Consume())
+		return 0;
+
+	// One budget for every database, each still gets at least one query through
+	std::chrono::steady_clock::time_point deadline = GetDispatchDeadline();
+
+	LUA->ReferencePush(iRefDatabases);
+	LUA->PushNil();
+
+	while (LUA->Next(-2))
+	{
+		LUA->Push(-2);
+
+		if (LUA->IsType(-2, DATABASE_ID))
+		{
+			UserData* userdata = (UserData*)LUA->GetUserdata(-2);
+			Database *mysqldb = (Database*)userdata->data;
+
+			if (mysqldb)
+				DispatchCompletedQueries(state, mysqldb, deadline);
+		}
+
+		LUA->Pop(2);
+	}
+	LUA->Pop();
+	return 0;
+}
+
+int geteventfd(lua_State* state)
+{
+	int fd = completionWakeup.GetEventFD();
+	if (fd < 0)
+		return 0;
+
+	LUA->PushNumber(fd);
+	return 1;
+}
+
+int setworkerthreads(lua_State* state)
+{
+	sharedExecutor.SetThreadCount((unsigned int)LUA->CheckNumber(1));
+	return 0;
+}
+
+// { cpus = { 2, 3 }, nice = 5, policy = "batch" }, returns false and an error if any of it couldn't be applied
+int setworkeroptions(lua_State* state)
+{
+	LUA->CheckType(1, Type::TABLE);
+
+	WorkerOptions options;
+
+	LUA->GetField(1, "cpus");
+	if (LUA->IsType(-1, Type::TABLE))
+	{
+		for (int i = 1;; i++)
+		{
+			LUA->PushNumber(i);
+			LUA->GetTable(-2);
+
+			if (!LUA->IsType(-1, Type::NUMBER))
+			{
+				LUA->Pop();
+				break;
+			}
+
+			options.cpus.push_back((int)LUA->GetNumber(-1));
+			LUA->Pop();
+		}
+	}
+	LUA->Pop();
+
+	LUA->GetField(1, "nice");
+	if (LUA->IsType(-1, Type::NUMBER))
+	{
+		options.setnice = true;
+		options.nice = (int)LUA->GetNumber(-1);
+	}
+	LUA->Pop();
+
+	LUA->GetField(1, "policy");
+	if (LUA->IsType(-1, Type::STRING))
+	{
+		std::string policy(LUA->GetString(-1));
+		if (policy == "other")
+			options.policy = WORKER_POLICY_OTHER;
+		else if (policy == "batch")
+			options.policy = WORKER_POLICY_BATCH;
+		else if (policy == "idle")
+			options.policy = WORKER_POLICY_IDLE;
+		else if (policy != "default")
+			LUA->ArgError(1, "policy must be \"default\", \"other\", \"batch\" or \"idle\"");
+	}
+	LUA->Pop();
+
+	std::string error;
+	LUA->PushBool(sharedExecutor.SetWorkerOptions(options, error));
+	LUA->PushString(error.c_str());
+	return 2;
+}
+
+int enablestatementstats(lua_State* state)
+{
+	statementStats.SetEnabled(LUA->GetBool(1));
+	return 0;
+}
+
+int resetstatementstats(lua_State* state)
+{
+	statementStats.Reset();
+	return 0;
+}
+
+double GetStatementStatsKey(const StatementStats& stats, const std::string& sortby)
+{
+	if (sortby == "calls")
+		return stats.calls;
+	if (sortby == "mean")
+		return stats.total / stats.calls;
+	if (sortby == "max")
+		return stats.max;
+	if (sortby == "p95")
+		return stats.GetPercentile(0.95);
+	if (sortby == "rows")
+		return stats.rows;
+	if (sortby == "bytes")
+		return stats.bytes;
+
+	return stats.total;
+}
+
+int getstatementstats(lua_State* state)
+{
+	size_t limit = LUA->IsType(1, Type::NUMBER) ? (size_t)LUA->GetNumber(1) : 0;
+	std::string sortby(LUA->IsType(2, Type::STRING) ? LUA->GetString(2) : "total");
+
+	std::vector<StatementStats> stats;
+	statementStats.Snapshot(stats);
+
+	std::sort(stats.begin(), stats.end(), [&](const StatementStats& a, const StatementStats& b)
+	{
+		return GetStatementStatsKey(a, sortby) > GetStatementStatsKey(b, sortby);
+	});
+
+	if (limit > 0 && stats.size() > limit)
+		stats.resize(limit);
+
+	LUA->CreateTable();
+	for (size_t i = 0; i < stats.size(); i++)
+	{
+		const StatementStats& entry = stats[i];
+
+		char fingerprint[17];
+		snprintf(fingerprint, sizeof(fingerprint), "%016llx", entry.fingerprint);
+
+		LUA->PushNumber((double)i + 1);
+		LUA->CreateTable();
+		{
+			LUA->PushString(entry.query.c_str(), entry.query.length());
+			LUA->SetField(-2, "query");
+			LUA->PushString(fingerprint);
+			LUA->SetField(-2, "fingerprint");
+			LUA->PushNumber(entry.calls);
+			LUA->SetField(-2, "calls");
+			LUA->PushNumber(entry.total);
+			LUA->SetField(-2, "total");
+			LUA->PushNumber(entry.total / entry.calls);
+			LUA->SetField(-2, "mean");
+			LUA->PushNumber(entry.min);
+			LUA->SetField(-2, "min");
+			LUA->PushNumber(entry.max);
+			LUA->SetField(-2, "max");
+			LUA->PushNumber(entry.GetPercentile(0.95));
+			LUA->SetField(-2, "p95");
+			LUA->PushNumber(entry.rows);
+			LUA->SetField(-2, "rows");
+			LUA->PushNumber(entry.bytes);
+			LUA->SetField(-2, "bytes");
+		}
+		LUA->SetTable(-3);
+	}
+	return 1;
+}
+
+int seterrorhandler(lua_State* state)
+{
+	if (iRefErrorHandler >= 0)
+		LUA->ReferenceFree(iRefErrorHandler);
+	iRefErrorHandler = -1;
+
+	if (LUA->IsType(1, Type::FUNCTION))
+	{
+		LUA->Push(1);
+		iRefErrorHandler = LUA->ReferenceCreate();
+	}
+	return 0;
+}
+
+// Seconds a PollAll may spend in callbacks, the rest waits for the next one. 0 dispatches everything
+int setdispatchbudget(lua_State* state)
+{
+	dispatch_budget = LUA->CheckNumber(1);
+	return 0;
+}
+
+// Where ExportQuery, WriteBlob and ReadBlobToFile paths start from, garrysmod/data/ by default. Held to the
+// same rules as those paths, relative to the game's directory, so it can't hand Lua the rest of the disk.
+int setfiledirectory(lua_State* state)
+{
+	std::string directory(LUA->CheckString(1));
+
+	if (IsAbsolutePath(directory))
+		LUA->ArgError(1, "directory must be relative to the game directory");
+
+	if (HasParentReference(directory))
+		LUA->ArgError(1, "directory must not contain \"..\"");
+
+	file_directory.swap(directory);
+
+	if (!file_directory.empty() && file_directory[file_directory.length() - 1] != '/' && file_directory[file_directory.length() - 1] != '\\')
+		file_directory.push_back('/');
+
+	return 0;
+}
+
+int setshutdowndeadline(lua_State* state)
+{
+	shutdown_deadline = LUA->CheckNumber(1);
+	return 0;
+}
+
+// Expects Shutdown to have finished every query already
+void DisconnectDB(lua_State* state,  Database* mysqldb )
+{
+	if (mysqldb)
+	{
+		// Frees it on the way out, unless this came from a callback of an earlier dispatch
+		mysqldb->SetDisconnected();
+		DispatchCompletedQueries(state, mysqldb);
+	}
+}
+
+void FreeDatabase(lua_State* state, Database* mysqldb)
+{
+	std::vector<int> freed;
+	mysqldb->GetQueryCache().Clear(freed);
+	FreeReferences(state, freed);
+
+	// Freeing it would pull the database out from under whatever is still stuck on it
+	if (mysqldb->IsAbandoned())
+	{
+		std::string warning = std::string("tmysql: ") + mysqldb->GetDatabase() + " didn't shut down in time, leaking it";
+
+		LUA->PushSpecial(GarrysMod::Lua::SPECIAL_GLOB);
+		LUA->GetField(-1, "print");
+		LUA->PushString(warning.c_str());
+		if (LUA->PCall(1, 0, 0) != 0)
+			LUA->Pop();
+		LUA->Pop();
+		return;
+	}
+
+	mysqldb->Release();
+	delete mysqldb;
+}
+
+// The handlers below report a failing callback through error rather than throw, dispatch has to finish first
+bool HandleConnectCallback(lua_State* state, Database* mysqldb, bool success, const std::string& error, std::string& callbackerror)
+{
+	int callback = mysqldb->GetConnectCallback();
+	if (callback < 0)
+		return true;
+
+	mysqldb->SetConnectCallback(-1);
+
+	LUA->ReferencePush(callback);
+	LUA->ReferenceFree(callback);
+
+	LUA->ReferencePush(iRefDatabases);
+	LUA->GetField(-1, mysqldb->GetDatabase());
+
+	// Like a failed Connect, a retry under the same name has to get a new database
+	if (!success && LUA->IsType(-1, DATABASE_ID) && ((UserData*)LUA->GetUserdata(-1))->data == mysqldb)
+	{
+		((UserData*)LUA->GetUserdata(-1))->data = NULL;
+
+		LUA->PushNil();
+		LUA->SetField(-3, mysqldb->GetDatabase());
+	}
+	LUA->Remove(-2);
+
+	LUA->PushBool(success);
+	LUA->PushString(error.c_str());
+
+	bool called = true;
+	if (LUA->PCall(3, 0, 0) != 0)
+	{
+		callbackerror.assign(LUA->GetString(-1));
+		LUA->Pop();
+		called = false;
+	}
+
+	// Freed once the dispatch we're in returns, unless it's being disconnected already
+	if (!success && !mysqldb->IsDisconnected())
+	{
+		mysqldb->BeginShutdown(-1);
+		mysqldb->Shutdown();
+		DisconnectDB(state, mysqldb);
+	}
+
+	return called;
+}
+
+void DispatchCompletedQueries(lua_State* state, Database* mysqldb, std::chrono::steady_clock::time_point deadline)
+{
+	mysqldb->EnterDispatch();
+
+	// The first callback error is raised once everything below is done with mysqldb
+	std::string callbackerror;
+	bool failed = false;
 
-	Database* mysqldb = new Database(host, user, pass, db, port, LUA->IsType(6, Type::STRING) ? LUA->GetString(6) : NULL, (int) LUA->GetNumber(7));
-	
+	bool success;
 	std::string error;
+	if (mysqldb->PopConnectResult(success, error))
+		failed = !HandleConnectCallback(state, mysqldb, success, error, callbackerror);
 
-	if ( !mysqldb->Initialize( error ) )
+	mysqldb->FlushCoalesced(false);
+
+	// Before any results, so none of them are served stale
+	std::vector<std::string> tables;
+	if (mysqldb->PopInvalidations(tables))
 	{
-		LUA->PushBool( false );
-		LUA->PushString(error.c_str());
-		delete mysqldb;
-		return 2;
+		std::vector<int> freed;
+		for (auto iter = tables.begin(); iter != tables.end(); ++iter)
+			mysqldb->InvalidateCache(*iter, freed);
+
+		FreeReferences(state, freed);
 	}
 
-	UserData* userdata = (UserData*)LUA->NewUserdata(sizeof(UserData));
-	userdata->data = mysqldb;
-	userdata->type = DATABASE_ID;
+	Query* completed = mysqldb->GetCompletedQueries();
 
-	int uData = LUA->ReferenceCreate();
+	while (completed)
+	{
+		Query* query = completed;
+		std::string queryerror;
+		bool called;
 
-	LUA->ReferencePush(iRefDatabases);
-	LUA->ReferencePush(uData);
-	LUA->SetField(-2, db);
+		if (query->GetScan())
+			called = HandleScanPage(state, mysqldb, query, queryerror);
+		else if (query->GetCallback() >= 0 || !query->GetFollowers().empty())
+			called = HandleQueryCallback(state, mysqldb, query, queryerror);
+		else
+			called = HandleQueryError(state, mysqldb, query, queryerror);
 
-	LUA->ReferencePush(uData);
-	LUA->ReferenceFree(uData);
-	LUA->CreateMetaTableType(DATABASE_NAME, DATABASE_ID);
-	LUA->SetMetaTable(-2);
-	return 1;
-}
+		if (!called && !failed)
+		{
+			callbackerror.swap(queryerror);
+			failed = true;
+		}
 
-int gettable(lua_State* state)
-{
-	LUA->ReferencePush(iRefDatabases);
-	return 1;
-}
+		completed = query->next;
+		delete query;
 
-int getdatabase(lua_State* state)
-{
-	LUA->ReferencePush(iRefDatabases);
-	LUA->GetField(-1, LUA->CheckString(1));
-	return 1;
+		// Out of time or about to raise an error, the rest goes first next tick. There is no next tick
+		// once it's disconnected.
+		if (completed && !mysqldb->IsDisconnected() && (failed || std::chrono::steady_clock::now() >= deadline))
+		{
+			mysqldb->DeferCompletedQueries(completed);
+			completionWakeup.Notify();
+			break;
+		}
+	}
+
+	if (mysqldb->LeaveDispatch())
+		FreeDatabase(state, mysqldb);
+
+	if (failed && !in_shutdown)
+		LUA->ThrowError(callbackerror.c_str());
 }
 
-int escape(lua_State* state)
+bool FinishScan(lua_State* state, TableScan* scan, std::string& error)
 {
-	LUA->CheckType(1, DATABASE_ID);
+	int done = scan->GetDoneCallback();
+	LUA->ReferenceFree(scan->GetBatchCallback());
+	scan->SetCallbacks(-1, -1);
 
-	UserData* userdata = (UserData*)LUA->GetUserdata(1);
-	Database *mysqldb = (Database*)userdata->data;
+	if (done < 0)
+		return true;
 
-	if ( !mysqldb )
-		return 0;
+	LUA->ReferencePush(done);
+	LUA->ReferenceFree(done);
 
-	const char* query = LUA->CheckString( 2 );
+	LUA->PushBool(scan->GetError().empty());
+	LUA->PushNumber(scan->GetRows());
+	if (scan->GetError().empty())
+		LUA->PushNil();
+	else
+		LUA->PushString(scan->GetError().c_str());
 
-	char* escaped = mysqldb->Escape( query );
-	LUA->PushString( escaped );
+	if (LUA->PCall(3, 0, 0) != 0)
+	{
+		error.assign(LUA->GetString(-1));
+		LUA->Pop();
+		return false;
+	}
 
-	delete[] escaped;
-	return 1;
+	return true;
 }
 
-int disconnect(lua_State* state)
+// Pages skip the callback slots, the scan holds on to its callbacks until it's over
+bool HandleScanPage(lua_State* state, Database* mysqldb, Query* query, std::string& error)
 {
-	LUA->CheckType( 1, DATABASE_ID );
+	std::shared_ptr<TableScan> scan = query->GetScan();
+	Result* result = query->GetResults().front();
 
-	UserData* userdata = (UserData*) LUA->GetUserdata(1);
-	Database *mysqldb = (Database*) userdata->data;
+	bool success = true;
+	if (result->GetErrorID() != 0)
+		scan->SetError(result->GetError());
+	else if (!scan->IsStopped() && result->GetDecoded().GetRowCount() > 0)
+	{
+		LUA->ReferencePush(scan->GetBatchCallback());
+		LUA->CreateTable();
+		PopulateTableFromDecoded(state, result->GetDecoded(), result->GetPlan(), scan->GetUseNumbers());
+		scan->AddRows(result->GetDecoded().GetRowCount());
 
-	if (!mysqldb)
-		return 0;
+		if (LUA->PCall(1, 1, 0) != 0)
+		{
+			error.assign(LUA->GetString(-1));
+			scan->SetError(error);
+			scan->Stop();
+			success = false;
+		}
+		else if (LUA->IsType(-1, Type::BOOL) && !LUA->GetBool(-1))
+			scan->Stop();
 
-	LUA->ReferencePush(iRefDatabases);
-		LUA->PushNil();
-		LUA->SetField(-2, mysqldb->GetDatabase());
-	LUA->Pop();
+		LUA->Pop();
+	}
 
-	DisconnectDB( state, mysqldb );
+	if (scan->PageDelivered() && !mysqldb->QueueScanPage(scan))
+		scan->Abort("Database is shutting down");
 
-	userdata->data = NULL;
-	return 0;
+	// The batch error wins over the done callback's
+	if (scan->IsOver())
+	{
+		std::string doneerror;
+		if (!FinishScan(state, scan.get(), doneerror) && success)
+		{
+			error.swap(doneerror);
+			success = false;
+		}
+	}
+
+	return success;
 }
 
-int setcharset(lua_State* state)
+// Expects the results table and the coroutine on top of the stack, pops the coroutine
+bool ResumeAwaitingQuery(lua_State* state, std::string& error)
 {
-	LUA->CheckType( 1, DATABASE_ID );
-
-	UserData* userdata = (UserData*)LUA->GetUserdata(1);
-	Database *mysqldb = (Database*)userdata->data;
+	LUA->ReferencePush(iRefCoroutineResume);
+	LUA->Insert(-2);
+	LUA->Push(-3);
 
-	if ( !mysqldb )
-		return 0;
+	if (LUA->PCall(2, 2, 0) != 0)
+	{
+		error.assign(LUA->GetString(-1));
+		LUA->Pop();
+		return false;
+	}
 
-	const char* set = LUA->CheckString(2);
+	bool success = LUA->GetBool(-2);
+	if (!success)
+		error.assign(LUA->IsType(-1, Type::STRING) ? LUA->GetString(-1) : "error in awaiting coroutine");
 
-	std::string error;
-	LUA->PushBool(mysqldb->SetCharacterSet( set, error ));
-	LUA->PushString(error.c_str());
-	return 2;
+	LUA->Pop(2);
+	return success;
 }
 
-int query(lua_State* state)
+// Expects the results table on top of the stack, leaves it there
+bool RunQueryCallback(lua_State* state, int callback, std::string& error)
 {
-	LUA->CheckType(1, DATABASE_ID);
+	CallbackSlotPush(state, callback, CALLBACK_CONTEXT);
+	if (LUA->IsType(-1, Type::TABLE))
+	{
+		CallbackSlotPush(state, callback, CALLBACK_OBJECT);
+		CallbackSlotFree(state, callback);
+		return CallbackGroupCollect(state, error);
+	}
+	if (LUA->IsType(-1, Type::THREAD))
+	{
+		CallbackSlotFree(state, callback);
+		return ResumeAwaitingQuery(state, error);
+	}
+	LUA->Pop();
 
-	UserData* userdata = (UserData*)LUA->GetUserdata(1);
-	Database *mysqldb = (Database*)userdata->data;
+	CallbackSlotPush(state, callback, CALLBACK_FUNCTION);
 
-	if ( !mysqldb )
-		return 0;
+	int args = 1;
+	CallbackSlotPush(state, callback, CALLBACK_OBJECT);
+	if (LUA->IsType(-1, Type::NIL))
+		LUA->Pop();
+	else
+		args = 2;
 
-	const char* query = LUA->CheckString(2);
+	CallbackSlotFree(state, callback);
 
-	int callbackfunc = -1;
-	if (LUA->GetType(3) == Type::FUNCTION)
-	{
-		LUA->Push(3);
-		callbackfunc = LUA->ReferenceCreate();
-	}
+	LUA->Push(-1 - args);
 
-	int callbackref = -1;
-	int callbackobj = LUA->GetType(4);
-	if (callbackobj != Type::NIL)
+	if (LUA->PCall(args, 0, 0) != 0)
 	{
-		LUA->Push(4);
-		callbackref = LUA->ReferenceCreate();
+		error.assign(LUA->GetString(-1));
+		LUA->Pop();
+		return false;
 	}
 
-	mysqldb->QueueQuery( query, callbackfunc, callbackref, LUA->GetBool(5) );
-	return 0;
+	return true;
 }
 
-int poll(lua_State* state)
+// Errors nobody has a callback for, such as failed write-behind statements
+bool HandleQueryError(lua_State* state, Database* mysqldb, Query* query, std::string& error)
 {
-	LUA->CheckType(1, DATABASE_ID);
+	if (iRefErrorHandler < 0)
+		return true;
 
-	UserData* userdata = (UserData*)LUA->GetUserdata(1);
-	Database *mysqldb = (Database*)userdata->data;
+	Results results = query->GetResults();
+	for (auto iter = results.begin(); iter != results.end(); ++iter)
+	{
+		Result* result = *iter;
+		if (result->GetErrorID() == 0)
+			continue;
 
-	if (!mysqldb)
-		return 0;
+		LUA->ReferencePush(iRefErrorHandler);
 
-	DispatchCompletedQueries(state, mysqldb);
-	return 0;
+		// An earlier callback may have disconnected it, its name could belong to a new database by now
+		if (mysqldb->IsDisconnected())
+			LUA->PushNil();
+		else
+		{
+			LUA->ReferencePush(iRefDatabases);
+			LUA->GetField(-1, mysqldb->GetDatabase());
+			LUA->Remove(-2);
+		}
+
+		LUA->PushString(query->GetQuery().c_str(), query->GetQuery().length());
+		LUA->PushString(result->GetError().c_str());
+		LUA->PushNumber(result->GetErrorID());
+
+		if (LUA->PCall(4, 0, 0) != 0)
+		{
+			error.assign(LUA->GetString(-1));
+			LUA->Pop();
+			return false;
+		}
+		return true;
+	}
+
+	return true;
 }
 
-/*
-	TMYSQL STUFFS
-*/
+void FreeReferences(lua_State* state, const std::vector<int>& refs)
+{
+	for (auto iter = refs.begin(); iter != refs.end(); ++iter)
+		LUA->ReferenceFree(*iter);
+}
 
-int pollall(lua_State* state)
+// Pushes a copy of the value at index, nested tables copied too. Only for the results tables we build
+// ourselves, those never refer back to themselves.
+void PushResultsCopy(lua_State* state, int index)
 {
-	LUA->ReferencePush(iRefDatabases);
+	LUA->Push(index);
+	if (!LUA->IsType(-1, Type::TABLE))
+		return;
+
+	LUA->CreateTable();
 	LUA->PushNil();
 
-	while (LUA->Next(-2))
+	while (LUA->Next(-3))
 	{
-		LUA->Push(-2);
+		PushResultsCopy(state, -1);
+		LUA->Push(-3);
+		LUA->Insert(-2);
+		LUA->SetTable(-5);
+		LUA->Pop();
+	}
 
-		if (LUA->IsType(-2, DATABASE_ID))
-		{
-			UserData* userdata = (UserData*)LUA->GetUserdata(-2);
-			Database *mysqldb = (Database*)userdata->data;
+	LUA->Remove(-2);
+}
 
-			if (mysqldb)
-				DispatchCompletedQueries(state, mysqldb);
-		}
+// Only complete, error free results are kept, and only if none of its tables changed while the query was out
+bool StoreCachedResults(lua_State* state, Database* mysqldb, Query* query)
+{
+	if (query->GetCacheKey().empty() || mysqldb->IsDisconnected() || !mysqldb->IsCacheCurrent(query->GetCacheTables(), query->GetCacheGeneration()))
+		return false;
 
-		LUA->Pop(2);
+	Results results = query->GetResults();
+	for (auto iter = results.begin(); iter != results.end(); ++iter)
+	{
+		if ((*iter)->GetErrorID() != 0)
+			return false;
 	}
-	LUA->Pop();
-	return 0;
+
+	LUA->Push(-1);
+	int replaced = mysqldb->GetQueryCache().Store(query->GetCacheKey(), LUA->ReferenceCreate(), query->GetCacheTables());
+	if (replaced >= 0)
+		LUA->ReferenceFree(replaced);
+	return true;
 }
 
-void DisconnectDB(lua_State* state,  Database* mysqldb )
+bool HandleQueryCallback(lua_State* state, Database* mysqldb, Query* query, std::string& error)
 {
-	if (mysqldb)
+	if (query->GetCachedRef() >= 0)
 	{
-		mysqldb->Shutdown();
-		DispatchCompletedQueries(state, mysqldb);
-
-		while (mysqldb->RunShutdownWork())
-			DispatchCompletedQueries(state, mysqldb);
-
-		mysqldb->Release();
-		delete mysqldb;
+		LUA->ReferencePush(query->GetCachedRef());
+		LUA->ReferenceFree(query->GetCachedRef());
+	}
+	else if (query->GetFormat() == FORMAT_JSON)
+		LUA->PushString(query->GetEncoded().c_str(), query->GetEncoded().length());
+	else
+	{
+		LUA->CreateTable();
+		PopulateTableFromQuery(state, query);
 	}
-}
 
-void DispatchCompletedQueries(lua_State* state, Database* mysqldb)
-{
-	Query* completed = mysqldb->GetCompletedQueries();
+	// A table the cache or another caller holds on to is copied for every callback, so none of them sees
+	// what the others did to it
+	const Followers& followers = query->GetFollowers();
+	bool shared = StoreCachedResults(state, mysqldb, query) || query->GetCachedRef() >= 0 || !followers.empty();
 
-	while (completed)
+	bool success = true;
+
+	if (query->GetCallback() >= 0)
 	{
-		Query* query = completed;
+		if (shared)
+			PushResultsCopy(state, -1);
 
-		if (query->GetCallback() >= 0)
-			HandleQueryCallback(state, query);
+		success = RunQueryCallback(state, query->GetCallback(), error);
 
-		completed = query->next;
-		delete query;
+		if (shared)
+			LUA->Pop();
 	}
-}
-
-void HandleQueryCallback(lua_State* state, Query* query)
-{
-	LUA->ReferencePush(query->GetCallback());
-	LUA->ReferenceFree(query->GetCallback());
 
-	if (!LUA->IsType(-1, Type::FUNCTION))
+	// Every coalesced caller runs, even after one failed
+	for (auto iter = followers.begin(); iter != followers.end(); ++iter)
 	{
+		if (iter->callback < 0)
+			continue;
+
+		std::string followererror;
+		PushResultsCopy(state, -1);
+		if (!RunQueryCallback(state, iter->callback, followererror) && success)
+		{
+			error.swap(followererror);
+			success = false;
+		}
 		LUA->Pop();
-		LUA->ReferenceFree(query->GetCallbackRef());
-		return;
 	}
 
-	int args = 1;
-	if (query->GetCallbackRef() >= 0)
-	{
-		args = 2;
-		LUA->ReferencePush(query->GetCallbackRef());
-		LUA->ReferenceFree(query->GetCallbackRef());
-	}
+	LUA->Pop();
+	return success;
+}
 
-	LUA->CreateTable();
-	PopulateTableFromQuery(state, query);
+int GetColumnKey(lua_State* state, const std::string& name)
+{
+	auto it = mapColumnKeys.find(name);
+	if (it != mapColumnKeys.end())
+		return it->second;
 
-	if (LUA->PCall(args, 0, 0) != 0 && !in_shutdown)
-	{
-		const char* err = LUA->GetString(-1);
-		LUA->ThrowError(err);
-	}
+	LUA->PushString(name.c_str(), name.length());
+	int key = LUA->ReferenceCreate();
+
+	mapColumnKeys[name] = key;
+	return key;
 }
 
-void PopulateTableFromResult(lua_State* state, MYSQL_RES* result, bool usenumbers)
+// The worker already typed every value. Schema columns come with interned keys, any other column's name is
+// made once per call rather than once per row and kept in a table on the stack meanwhile.
+void PopulateTableFromDecoded(lua_State* state, const DecodedResult& decoded, const DecoderPlan& plan, bool usenumbers)
 {
-	// no result to push, continue, this isn't fatal
-	if (result == NULL)
-		return;
+	unsigned int field_count = decoded.GetColumnCount();
+	int target = LUA->Top();
 
-	MYSQL_ROW row = mysql_fetch_row(result);
-	MYSQL_FIELD *fields = mysql_fetch_fields(result);
+	int names = 0;
+	if (!usenumbers && plan.empty())
+	{
+		LUA->CreateTable();
+		names = LUA->Top();
 
-	int rowid = 1;
+		for (unsigned int i = 0; i < field_count; i++)
+		{
+			const std::string& name = decoded.GetColumnName(i);
+			LUA->PushNumber(i + 1);
+			LUA->PushString(name.c_str(), name.length());
+			LUA->SetTable(names);
+		}
+	}
 
-	while (row)
+	for (size_t rowid = 0; rowid < decoded.GetRowCount(); rowid++)
 	{
-		unsigned int field_count = mysql_num_fields(result);
-		unsigned long *lengths = mysql_fetch_lengths(result);
+		const DecodedCell* row = decoded.GetRow(rowid);
 
-		// black magic warning: we use a temp and assign it so that we avoid consuming all the temp objects and causing horrible disasters
+		LUA->PushNumber((double)rowid + 1);
 		LUA->CreateTable();
-		int resultrow = LUA->ReferenceCreate();
-
-		LUA->PushNumber(rowid++);
-		LUA->ReferencePush(resultrow);
-		LUA->ReferenceFree(resultrow);
 
 		for (unsigned int i = 0; i < field_count; i++)
 		{
-			if (usenumbers == true)
-				LUA->PushNumber(i+1);
+			const DecodedCell& cell = row[i];
+			if (cell.type == DECODED_NULL)
+				continue;
 
-			if (row[i] == NULL)
-				LUA->PushNil();
-			else if (IS_NUM(fields[i].type) && fields[i].type != MYSQL_TYPE_LONGLONG)
-				LUA->PushNumber(atof(row[i]));
+			if (usenumbers)
+				LUA->PushNumber(i + 1);
+			else if (names)
+			{
+				LUA->PushNumber(i + 1);
+				LUA->GetTable(names);
+			}
 			else
-				LUA->PushString(row[i], lengths[i]);
+				LUA->ReferencePush(plan[i]->key);
 
-			if (usenumbers == true)
-				LUA->SetTable(-3);
-			else
-				LUA->SetField(-2, fields[i].name);
-		}
+			switch (cell.type)
+			{
+			case DECODED_NUMBER:
+				LUA->PushNumber(cell.number);
+				break;
+			case DECODED_BOOL:
+				LUA->PushBool(cell.number != 0);
+				break;
+			default:
+				LUA->PushString(decoded.GetString(cell), cell.string.length);
+			}
 
-		LUA->SetTable(-3);
+			LUA->SetTable(-3);
+		}
 
-		row = mysql_fetch_row(result);
+		LUA->SetTable(target);
 	}
+
+	if (names)
+		LUA->Pop();
 }
 
 void PopulateTableFromQuery(lua_State* state, Query* query)
@@ -340,13 +2297,18 @@ void PopulateTableFromQuery(lua_State* state, Query* query)
 				LUA->SetField(-2, "error");
 				LUA->PushNumber(result->GetErrorID());
 				LUA->SetField(-2, "errorid");
+			} else if (result->IsExported()) {
+				LUA->PushNumber(result->GetExportedRows());
+				LUA->SetField(-2, "rows");
+				LUA->PushNumber(result->GetExportedBytes());
+				LUA->SetField(-2, "bytes");
 			} else {
 				LUA->PushNumber(result->GetAffected());
 				LUA->SetField(-2, "affected");
 				LUA->PushNumber(result->GetLastID());
 				LUA->SetField(-2, "lastid");
 				LUA->CreateTable();
-				PopulateTableFromResult(state, result->GetResult(), query->GetUseNumbers());
+				PopulateTableFromDecoded(state, result->GetDecoded(), result->GetPlan(), query->GetUseNumbers());
 				LUA->SetField(-2, "data");
 			}
 #ifdef ENABLE_QUERY_TIMERS
@@ -364,10 +2326,16 @@ GMOD_MODULE_OPEN()
 	mysql_library_init(0, NULL, NULL);
 
 	in_shutdown = false;
+	completionWakeup.Reset();
 
 	LUA->CreateTable();
 	iRefDatabases = LUA->ReferenceCreate();
 
+	LUA->CreateTable();
+	iRefCallbacks = LUA->ReferenceCreate();
+	iNextCallbackSlot = 0;
+	vecFreeCallbackSlots.clear();
+
 	LUA->PushSpecial(GarrysMod::Lua::SPECIAL_GLOB);
 	{
 		LUA->PushNumber(mysql_get_client_version());
@@ -407,16 +2375,60 @@ GMOD_MODULE_OPEN()
 
 		LUA->CreateTable();
 		{
+			LUA->PushNumber(QUERY_ERROR_TIMEOUT);
+			LUA->SetField(-2, "ERROR_TIMEOUT");
+			LUA->PushNumber(QUERY_ERROR_CANCELLED);
+			LUA->SetField(-2, "ERROR_CANCELLED");
+			LUA->PushNumber(QUERY_ERROR_REJECTED);
+			LUA->SetField(-2, "ERROR_REJECTED");
+			LUA->PushNumber(QUERY_ERROR_DROPPED);
+			LUA->SetField(-2, "ERROR_DROPPED");
+			LUA->PushNumber(QUERY_ERROR_SHUTDOWN);
+			LUA->SetField(-2, "ERROR_SHUTDOWN");
+			LUA->PushNumber(QUERY_ERROR_SCHEMA);
+			LUA->SetField(-2, "ERROR_SCHEMA");
+
+			LUA->PushNumber(BACKPRESSURE_REJECT);
+			LUA->SetField(-2, "BACKPRESSURE_REJECT");
+			LUA->PushNumber(BACKPRESSURE_DROP_OLDEST);
+			LUA->SetField(-2, "BACKPRESSURE_DROP_OLDEST");
+			LUA->PushNumber(BACKPRESSURE_BLOCK);
+			LUA->SetField(-2, "BACKPRESSURE_BLOCK");
+
 			LUA->PushCFunction(initialize);
 			LUA->SetField(-2, "initialize");
 			LUA->PushCFunction(initialize);
 			LUA->SetField(-2, "Connect");
+			LUA->PushCFunction(initializeasync);
+			LUA->SetField(-2, "ConnectAsync");
 			LUA->PushCFunction(gettable);
 			LUA->SetField(-2, "GetTable");
 			LUA->PushCFunction(getdatabase);
 			LUA->SetField(-2, "GetDatabase");
 			LUA->PushCFunction(pollall);
 			LUA->SetField(-2, "PollAll");
+			LUA->PushCFunction(shardeddatabase);
+			LUA->SetField(-2, "ShardedDatabase");
+			LUA->PushCFunction(seterrorhandler);
+			LUA->SetField(-2, "SetErrorHandler");
+			LUA->PushCFunction(setshutdowndeadline);
+			LUA->SetField(-2, "SetShutdownDeadline");
+			LUA->PushCFunction(setdispatchbudget);
+			LUA->SetField(-2, "SetDispatchBudget");
+			LUA->PushCFunction(setfiledirectory);
+			LUA->SetField(-2, "SetFileDirectory");
+			LUA->PushCFunction(geteventfd);
+			LUA->SetField(-2, "GetEventFD");
+			LUA->PushCFunction(setworkerthreads);
+			LUA->SetField(-2, "SetWorkerThreads");
+			LUA->PushCFunction(setworkeroptions);
+			LUA->SetField(-2, "SetWorkerOptions");
+			LUA->PushCFunction(enablestatementstats);
+			LUA->SetField(-2, "EnableStatementStats");
+			LUA->PushCFunction(getstatementstats);
+			LUA->SetField(-2, "GetStatementStats");
+			LUA->PushCFunction(resetstatementstats);
+			LUA->SetField(-2, "ResetStatementStats");
 		}
 		LUA->SetField(-2, "tmysql");
 
@@ -443,6 +2455,18 @@ GMOD_MODULE_OPEN()
 
 		LUA->PushCFunction(query);
 		LUA->SetField(-2, "Query");
+		LUA->PushCFunction(querybatch);
+		LUA->SetField(-2, "QueryBatch");
+		LUA->PushCFunction(exportquery);
+		LUA->SetField(-2, "ExportQuery");
+		LUA->PushCFunction(writeblob);
+		LUA->SetField(-2, "WriteBlob");
+		LUA->PushCFunction(readblobtofile);
+		LUA->SetField(-2, "ReadBlobToFile");
+		LUA->PushCFunction(scan);
+		LUA->SetField(-2, "Scan");
+		LUA->PushCFunction(registerschema);
+		LUA->SetField(-2, "RegisterSchema");
 		LUA->PushCFunction(escape);
 		LUA->SetField(-2, "Escape");
 		LUA->PushCFunction(disconnect);
@@ -451,9 +2475,86 @@ GMOD_MODULE_OPEN()
 		LUA->SetField(-2, "SetCharacterSet");
 		LUA->PushCFunction(poll);
 		LUA->SetField(-2, "Poll");
+		LUA->PushCFunction(cancel);
+		LUA->SetField(-2, "Cancel");
+		LUA->PushCFunction(setqueuelimits);
+		LUA->SetField(-2, "SetQueueLimits");
+		LUA->PushCFunction(getstats);
+		LUA->SetField(-2, "GetStats");
+		LUA->PushCFunction(setcoalescereads);
+		LUA->SetField(-2, "SetCoalesceReads");
+		LUA->PushCFunction(setslowquerylog);
+		LUA->SetField(-2, "SetSlowQueryLog");
+		LUA->PushCFunction(getslowqueries);
+		LUA->SetField(-2, "GetSlowQueries");
+		LUA->PushCFunction(setwritebehind);
+		LUA->SetField(-2, "SetWriteBehind");
+		LUA->PushCFunction(upsertcoalesced);
+		LUA->SetField(-2, "UpsertCoalesced");
+		LUA->PushCFunction(setupsertinterval);
+		LUA->SetField(-2, "SetUpsertInterval");
+		LUA->PushCFunction(flushcoalesced);
+		LUA->SetField(-2, "FlushCoalesced");
+
+		LUA->PushCFunction(enablebinloginvalidation);
+		LUA->SetField(-2, "EnableBinlogInvalidation");
+
+		LUA->PushCFunction(invalidatecache);
+		LUA->SetField(-2, "InvalidateCache");
+
+		LUA->PushCFunction(clearcache);
+		LUA->SetField(-2, "ClearCache");
+	}
+	LUA->Pop(1);
+
+	LUA->CreateMetaTableType(SHARDED_NAME, SHARDED_ID);
+	{
+		LUA->Push(-1);
+		LUA->SetField(-2, "__index");
+		LUA->PushCFunction(shardedgc);
+		LUA->SetField(-2, "__gc");
+
+		LUA->PushCFunction(shardedquery);
+		LUA->SetField(-2, "Query");
+		LUA->PushCFunction(shardedqueryall);
+		LUA->SetField(-2, "QueryAll");
+		LUA->PushCFunction(shardedgetshard);
+		LUA->SetField(-2, "GetShard");
 	}
 	LUA->Pop(1);
 
+	LUA->PushSpecial(GarrysMod::Lua::SPECIAL_GLOB);
+	{
+		LUA->GetField(-1, "coroutine");
+		LUA->GetField(-1, "resume");
+		iRefCoroutineResume = LUA->ReferenceCreate();
+		LUA->Pop();
+
+		LUA->GetField(-1, "CompileString");
+		LUA->PushString(AWAIT_LUA);
+		LUA->PushString("tmysql4");
+		LUA->Call(2, 1);
+		LUA->PushCFunction(query);
+		LUA->PushCFunction(shardedquery);
+		LUA->Call(2, 3);
+
+		LUA->GetField(-4, "tmysql");
+		LUA->Push(-2);
+		LUA->SetField(-2, "Run");
+		LUA->Pop(2);
+
+		LUA->CreateMetaTableType(SHARDED_NAME, SHARDED_ID);
+		LUA->Push(-2);
+		LUA->SetField(-2, "QueryAwait");
+		LUA->Pop(2);
+
+		LUA->CreateMetaTableType(DATABASE_NAME, DATABASE_ID);
+		LUA->Push(-2);
+		LUA->SetField(-2, "QueryAwait");
+		LUA->Pop(2);
+	}
+	LUA->Pop();
+
 	return 0;
 }
 
@@ -461,6 +2562,8 @@ void closeAllDatabases(lua_State* state)
 {
 	in_shutdown = true;
 
+	std::vector<Database*> databases;
+
 	LUA->ReferencePush(iRefDatabases);
 	LUA->PushNil();
 
@@ -474,18 +2577,41 @@ void closeAllDatabases(lua_State* state)
 			Database *mysqldb = (Database*)userdata->data;
 
 			if (mysqldb)
-				DisconnectDB(state, mysqldb);
+			{
+				databases.push_back(mysqldb);
+				userdata->data = NULL;
+			}
 		}
 
 		LUA->Pop(2);
 	}
 	LUA->Pop();
+
+	// Let every database drain at once rather than one after another
+	for (auto iter = databases.begin(); iter != databases.end(); ++iter)
+		(*iter)->BeginShutdown(shutdown_deadline);
+
+	for (auto iter = databases.begin(); iter != databases.end(); ++iter)
+	{
+		(*iter)->Shutdown();
+		DisconnectDB(state, *iter);
+	}
 }
 
 GMOD_MODULE_CLOSE()
 {
 	closeAllDatabases(state);
+	sharedExecutor.Stop();
+	completionWakeup.CloseEventFD();
 	LUA->ReferenceFree(iRefDatabases);
+	LUA->ReferenceFree(iRefCallbacks);
+	if (iRefErrorHandler >= 0)
+		LUA->ReferenceFree(iRefErrorHandler);
+	iRefErrorHandler = -1;
+	LUA->ReferenceFree(iRefCoroutineResume);
+	for (auto iter = mapColumnKeys.begin(); iter != mapColumnKeys.end(); ++iter)
+		LUA->ReferenceFree(iter->second);
+	mapColumnKeys.clear();
 	mysql_library_end();
 	return 0;
 }
\ No newline at end of file
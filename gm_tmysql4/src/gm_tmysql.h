@@ -3,6 +3,18 @@
 #endif
 
 #include <mysql.h>
+#include <errmsg.h>
 
 #include "Lua/Interface.h"
-#include "database.h"
\ No newline at end of file
+#include "executor.h"
+#include "wakeup.h"
+#include "slowlog.h"
+#include "statementstats.h"
+#include "shardeddatabase.h"
+#include "schema.h"
+#include "decodedresult.h"
+#include "binlog.h"
+#include "querycache.h"
+#include "database.h"
+#include "scan.h"
+#include "encode.h"
\ No newline at end of file
@@ -0,0 +1,78 @@
+#include "gm_tmysql.h"
+
+int QueryCache::Find(const std::string& key)
+{
+	auto it = m_entries.find(key);
+	if (it == m_entries.end())
+		return -1;
+
+	m_iHits++;
+	return it->second.ref;
+}
+
+int QueryCache::Store(const std::string& key, int ref, const std::vector<std::string>& tables)
+{
+	std::vector<int> freed;
+
+	auto it = m_entries.find(key);
+	if (it != m_entries.end())
+		Erase(it, freed);
+
+	Entry& entry = m_entries[key];
+	entry.ref = ref;
+	entry.tables = tables;
+
+	for (auto iter = tables.begin(); iter != tables.end(); ++iter)
+		m_tags.insert(std::make_pair(*iter, key));
+
+	return freed.empty() ? -1 : freed.front();
+}
+
+void QueryCache::Invalidate(const std::string& table, std::vector<int>& freed)
+{
+	// Erase drops the tags as well, look the next one up every time
+	for (;;)
+	{
+		auto tag = m_tags.find(table);
+		if (tag == m_tags.end())
+			break;
+
+		auto it = m_entries.find(tag->second);
+		if (it == m_entries.end())
+		{
+			m_tags.erase(tag);
+			continue;
+		}
+
+		Erase(it, freed);
+	}
+}
+
+void QueryCache::Clear(std::vector<int>& freed)
+{
+	for (auto iter = m_entries.begin(); iter != m_entries.end(); ++iter)
+		freed.push_back(iter->second.ref);
+
+	m_entries.clear();
+	m_tags.clear();
+}
+
+void QueryCache::Erase(Entries::iterator entry, std::vector<int>& freed)
+{
+	const std::string& key = entry->first;
+
+	for (auto table = entry->second.tables.begin(); table != entry->second.tables.end(); ++table)
+	{
+		auto range = m_tags.equal_range(*table);
+		for (auto tag = range.first; tag != range.second;)
+		{
+			if (tag->second == key)
+				tag = m_tags.erase(tag);
+			else
+				++tag;
+		}
+	}
+
+	freed.push_back(entry->second.ref);
+	m_entries.erase(entry);
+}
\ No newline at end of file
@@ -0,0 +1,38 @@
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Results of cached queries as registry references, tagged with the tables they read. Main thread only,
+// freeing the references is left to the caller since only it can touch the Lua state.
+class QueryCache
+{
+public:
+	QueryCache(void) : m_iHits(0) {}
+
+	// The cached reference, -1 on a miss
+	int				Find(const std::string& key);
+	// Returns the reference it replaced, -1 if there was none
+	int				Store(const std::string& key, int ref, const std::vector<std::string>& tables);
+
+	// Entries tagged with table, the references they held are appended to freed
+	void			Invalidate(const std::string& table, std::vector<int>& freed);
+	void			Clear(std::vector<int>& freed);
+
+	size_t			GetSize(void) { return m_entries.size(); }
+	unsigned int	GetHits(void) { return m_iHits; }
+
+private:
+	struct Entry
+	{
+		int							ref;
+		std::vector<std::string>	tables;
+	};
+
+	typedef std::unordered_map<std::string, Entry> Entries;
+
+	void			Erase(Entries::iterator entry, std::vector<int>& freed);
+
+	Entries			m_entries;
+	std::unordered_multimap<std::string, std::string> m_tags;	// Table to key
+	unsigned int	m_iHits;
+};
\ No newline at end of file
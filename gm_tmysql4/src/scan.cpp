@@ -0,0 +1,148 @@
+#include "gm_tmysql.h"
+
+#include <cstring>
+
+TableScan::TableScan(const std::string& table, const std::string& key, const std::string& where, unsigned int batch, unsigned int prefetch) :
+	m_strTable(table), m_strKey(key), m_strWhere(where), m_iBatch(batch > 0 ? batch : 1), m_iPrefetch(prefetch),
+	m_bHasLast(false), m_bInFlight(true), m_iUndelivered(0), m_bFinished(false), m_bStopped(false),
+	m_iBatchCallback(-1), m_iDoneCallback(-1), m_bUseNumbers(false), m_dRows(0)
+{
+}
+
+std::string TableScan::BuildQuery(void)
+{
+	std::string key(Database::QuoteIdentifier(m_strKey));
+	std::string query("SELECT * FROM " + Database::QuoteIdentifier(m_strTable));
+
+	if (!m_strWhere.empty())
+		query.append(" WHERE (" + m_strWhere + ")");
+
+	{
+		std::lock_guard<std::mutex> guard(m_Mutex);
+
+		if (m_bHasLast)
+		{
+			query.append(m_strWhere.empty() ? " WHERE " : " AND ");
+			query.append(key + " > '" + m_strLast + "'");
+		}
+	}
+
+	char limit[32];
+	snprintf(limit, sizeof(limit), " LIMIT %u", m_iBatch);
+	query.append(" ORDER BY " + key + limit);
+	return query;
+}
+
+// Column names come without the table, compare against the key's last part
+static int FindKeyColumn(MYSQL_RES* result, const std::string& key)
+{
+	size_t dot = key.rfind('.');
+	const char* name = key.c_str() + (dot == std::string::npos ? 0 : dot + 1);
+
+	unsigned int count = mysql_num_fields(result);
+	MYSQL_FIELD* fields = mysql_fetch_fields(result);
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+#ifdef _WIN32
+		if (_stricmp(fields[i].name, name) == 0)
+#else
+		if (strcasecmp(fields[i].name, name) == 0)
+#endif
+			return (int)i;
+	}
+	return -1;
+}
+
+bool TableScan::PageCompleted(MYSQL* mysql, Result* result, bool cancontinue)
+{
+	MYSQL_RES* res = result->GetErrorID() == 0 ? result->GetResult() : NULL;
+
+	std::string last;
+	bool more = false;
+
+	if (res != NULL && mysql_num_rows(res) > 0)
+	{
+		int column = FindKeyColumn(res, m_strKey);
+
+		mysql_data_seek(res, mysql_num_rows(res) - 1);
+		MYSQL_ROW row = mysql_fetch_row(res);
+		unsigned long* lengths = mysql_fetch_lengths(res);
+
+		if (column < 0)
+		{
+			result->SetErrorID(QUERY_ERROR_SCHEMA);
+			result->SetError(("Scan key column " + m_strKey + " is not in the result").c_str());
+		}
+		else if (row == NULL || row[column] == NULL)
+		{
+			result->SetErrorID(QUERY_ERROR_SCHEMA);
+			result->SetError(("Scan key column " + m_strKey + " is NULL").c_str());
+		}
+		else
+		{
+			last.resize(lengths[column] * 2 + 1);
+			last.resize(mysql_real_escape_string(mysql, &last[0], row[column], lengths[column]));
+			more = mysql_num_rows(res) >= m_iBatch;
+		}
+
+		// The main thread still has to see every row
+		mysql_data_seek(res, 0);
+	}
+
+	std::lock_guard<std::mutex> guard(m_Mutex);
+
+	m_iUndelivered++;
+
+	if (more)
+	{
+		m_strLast.swap(last);
+		m_bHasLast = true;
+	}
+	else
+		m_bFinished = true;
+
+	m_bInFlight = cancontinue && !m_bFinished && !m_bStopped && m_iUndelivered <= m_iPrefetch;
+	return m_bInFlight;
+}
+
+bool TableScan::PageDelivered(void)
+{
+	std::lock_guard<std::mutex> guard(m_Mutex);
+
+	m_iUndelivered--;
+
+	if (m_bInFlight || m_bFinished || m_bStopped || m_iUndelivered > m_iPrefetch)
+		return false;
+
+	m_bInFlight = true;
+	return true;
+}
+
+void TableScan::Stop(void)
+{
+	std::lock_guard<std::mutex> guard(m_Mutex);
+	m_bStopped = true;
+}
+
+bool TableScan::IsStopped(void)
+{
+	std::lock_guard<std::mutex> guard(m_Mutex);
+	return m_bStopped;
+}
+
+void TableScan::Abort(const std::string& error)
+{
+	{
+		std::lock_guard<std::mutex> guard(m_Mutex);
+		m_bInFlight = false;
+		m_bFinished = true;
+	}
+	SetError(error);
+}
+
+bool TableScan::IsOver(void)
+{
+	std::lock_guard<std::mutex> guard(m_Mutex);
+	return !m_bInFlight && m_iUndelivered == 0 && (m_bFinished || m_bStopped);
+}
\ No newline at end of file
@@ -0,0 +1,67 @@
+#include <mutex>
+#include <string>
+
+// A keyset paginated walk over a table: WHERE key > last ORDER BY key LIMIT batch. Each page is a query of
+// its own. The worker that ran a page queues the next one right away while at most prefetch pages wait for
+// Lua, the main thread picks the scan up again once Lua has caught up.
+class TableScan
+{
+public:
+	TableScan(const std::string& table, const std::string& key, const std::string& where, unsigned int batch, unsigned int prefetch);
+
+	// SQL of the next page, after the last key seen so far
+	std::string		BuildQuery(void);
+
+	// Worker, once per page, also for pages that failed before they ran. Notes the page's last key and
+	// whether there are more. Returns whether the next page should be queued now.
+	bool			PageCompleted(MYSQL* mysql, Result* result, bool cancontinue);
+
+	// Main thread, after Lua had the page. Returns whether the next page has to be queued now.
+	bool			PageDelivered(void);
+
+	// Ends the scan early, pages still in flight are discarded
+	void			Stop(void);
+	bool			IsStopped(void);
+	// The next page couldn't be queued
+	void			Abort(const std::string& error);
+
+	// Finished or stopped with nothing in flight and nothing left to deliver
+	bool			IsOver(void);
+
+	// Set before the first page is queued, every page is queued with them
+	void			SetOptions(const QueryOptions& options) { m_options = options; }
+	const QueryOptions& GetOptions(void) { return m_options; }
+
+	// Main thread only
+	void			SetCallbacks(int batch, int done) { m_iBatchCallback = batch; m_iDoneCallback = done; }
+	int				GetBatchCallback(void) { return m_iBatchCallback; }
+	int				GetDoneCallback(void) { return m_iDoneCallback; }
+	void			SetUseNumbers(bool usenumbers) { m_bUseNumbers = usenumbers; }
+	bool			GetUseNumbers(void) { return m_bUseNumbers; }
+	void			AddRows(size_t rows) { m_dRows += rows; }
+	double			GetRows(void) { return m_dRows; }
+	void			SetError(const std::string& error) { if (m_strError.empty()) m_strError = error; }
+	const std::string& GetError(void) { return m_strError; }
+
+private:
+	std::string		m_strTable;
+	std::string		m_strKey;
+	std::string		m_strWhere;
+	unsigned int	m_iBatch;
+	unsigned int	m_iPrefetch;
+	QueryOptions	m_options;
+
+	std::mutex		m_Mutex;
+	std::string		m_strLast;			// Escaped, ready to go between quotes
+	bool			m_bHasLast;
+	bool			m_bInFlight;		// A page is queued or running
+	unsigned int	m_iUndelivered;		// Pages completed but not yet handed to Lua
+	bool			m_bFinished;
+	bool			m_bStopped;
+
+	int				m_iBatchCallback;
+	int				m_iDoneCallback;
+	bool			m_bUseNumbers;
+	double			m_dRows;
+	std::string		m_strError;
+};
\ No newline at end of file
@@ -0,0 +1,69 @@
+#include "gm_tmysql.h"
+
+#include <cstring>
+
+void ResultSchema::AddColumn(const std::string& name, SchemaType type, int key)
+{
+	SchemaColumn column;
+	column.name = name;
+	column.type = type;
+	column.key = key;
+	m_columns.push_back(column);
+}
+
+bool ResultSchema::Plan(MYSQL_FIELD* fields, unsigned int count, DecoderPlan& plan, std::string& error) const
+{
+	plan.clear();
+	plan.reserve(count);
+
+	std::vector<bool> matched(m_columns.size(), false);
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		const SchemaColumn* match = NULL;
+		for (auto iter = m_columns.begin(); iter != m_columns.end(); ++iter)
+		{
+			if (iter->name.length() == fields[i].name_length && memcmp(iter->name.data(), fields[i].name, fields[i].name_length) == 0)
+			{
+				match = &*iter;
+				matched[iter - m_columns.begin()] = true;
+				break;
+			}
+		}
+
+		if (match == NULL)
+		{
+			error.assign("Result doesn't match schema " + m_strName + ", unexpected column " + fields[i].name);
+			return false;
+		}
+
+		plan.push_back(match);
+	}
+
+	for (size_t i = 0; i < m_columns.size(); i++)
+	{
+		if (!matched[i])
+		{
+			error.assign("Result doesn't match schema " + m_strName + ", missing column " + m_columns[i].name);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool ResultSchema::ParseType(const std::string& name, SchemaType& type)
+{
+	if (name == "string")
+		type = SCHEMA_STRING;
+	else if (name == "number")
+		type = SCHEMA_NUMBER;
+	else if (name == "int")
+		type = SCHEMA_INT;
+	else if (name == "bool")
+		type = SCHEMA_BOOL;
+	else
+		return false;
+
+	return true;
+}
\ No newline at end of file
@@ -0,0 +1,42 @@
+#include <memory>
+#include <string>
+#include <vector>
+
+enum SchemaType
+{
+	SCHEMA_STRING,
+	SCHEMA_NUMBER,
+	SCHEMA_INT,
+	SCHEMA_BOOL,
+};
+
+struct SchemaColumn
+{
+	std::string		name;
+	SchemaType		type;
+	int				key;		// Registry reference to the interned Lua key, main thread only
+};
+
+// The expected columns of a result, by name. Matching one against a result gives the decoder plan,
+// the schema column for every result column in order, so rows are decoded without looking at field types.
+class ResultSchema
+{
+public:
+	ResultSchema(const std::string& name) : m_strName(name) {}
+
+	const std::string&	GetName(void) const { return m_strName; }
+
+	void				AddColumn(const std::string& name, SchemaType type, int key);
+
+	// Fails when a column is missing on either side
+	bool				Plan(MYSQL_FIELD* fields, unsigned int count, std::vector<const struct SchemaColumn*>& plan, std::string& error) const;
+
+	static bool			ParseType(const std::string& name, SchemaType& type);
+
+private:
+	std::string			m_strName;
+	std::vector<SchemaColumn> m_columns;
+};
+
+typedef std::shared_ptr<const ResultSchema> SchemaPtr;
+typedef std::vector<const SchemaColumn*> DecoderPlan;
\ No newline at end of file
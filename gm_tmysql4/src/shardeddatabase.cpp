@@ -0,0 +1,27 @@
+#include "gm_tmysql.h"
+
+int ShardedDatabase::GetShard(const std::string& key)
+{
+	// Same FNV-1a the statement fingerprints use
+	unsigned long long hash = StatementStatsTable::Hash(key);
+
+	if (m_iHash == SHARD_HASH_MODULO)
+		return (int)(hash % m_iShards);
+
+	return JumpConsistentHash(hash, m_iShards);
+}
+
+// Lamping and Veach, "A Fast, Minimal Memory, Consistent Hash Algorithm"
+int ShardedDatabase::JumpConsistentHash(unsigned long long key, int buckets)
+{
+	long long b = -1, j = 0;
+
+	while (j < buckets)
+	{
+		b = j;
+		key = key * 2862933555777941757ULL + 1;
+		j = (long long)((b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1)));
+	}
+
+	return (int)b;
+}
\ No newline at end of file
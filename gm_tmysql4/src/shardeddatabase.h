@@ -0,0 +1,28 @@
+#include <string>
+
+enum ShardHash
+{
+	SHARD_HASH_JUMP,
+	SHARD_HASH_MODULO,
+};
+
+// Routes keys onto a fixed list of Database userdata kept in a Lua table referenced by m_iRefDatabases.
+// Jump hashing moves only 1/n of the keys when a shard is appended, modulo is kept for existing layouts.
+class ShardedDatabase
+{
+public:
+	ShardedDatabase(int databases, int shards, ShardHash hash) : m_iRefDatabases(databases), m_iShards(shards), m_iHash(hash) {}
+
+	int			GetDatabases(void) { return m_iRefDatabases; }
+	int			GetShardCount(void) { return m_iShards; }
+
+	// Zero based
+	int			GetShard(const std::string& key);
+
+	static int	JumpConsistentHash(unsigned long long key, int buckets);
+
+private:
+	int			m_iRefDatabases;
+	int			m_iShards;
+	ShardHash	m_iHash;
+};
\ No newline at end of file
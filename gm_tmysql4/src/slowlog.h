@@ -0,0 +1,87 @@
+#include <atomic>
+#include <vector>
+#include <ctime>
+
+#define SLOWLOG_SIZE 128
+#define SLOWLOG_QUERY_LENGTH 256
+#define SLOWLOG_SOURCE_LENGTH 128
+#define SLOWLOG_KEY_LENGTH 64
+#define SLOWLOG_ACCESS_LENGTH 16
+
+struct SlowQueryEntry
+{
+	char		query[SLOWLOG_QUERY_LENGTH];	// Truncated
+	char		source[SLOWLOG_SOURCE_LENGTH];	// Lua location of the callback or caller
+	time_t		when;
+	double		queuetime;						// Seconds from submission until a worker took it
+	double		exectime;						// Seconds in mysql_real_query
+	double		fetchtime;						// Seconds storing the results
+	double		rows;
+	double		bytes;
+	int			errorid;
+
+	// Summary of EXPLAIN FORMAT=JSON, only filled in when explained is set
+	bool		explained;
+	char		access[SLOWLOG_ACCESS_LENGTH];	// Worst access_type, ALL when any table is scanned
+	char		key[SLOWLOG_KEY_LENGTH];		// First index used
+	double		examined;						// Largest rows_examined_per_scan
+	bool		filesort;
+	bool		temporary;
+	bool		fullscan;
+};
+
+// Fixed-size ring of the most recent slow queries. Workers claim a slot with a single atomic
+// increment and never wait on each other or on readers. Each slot carries a sequence number
+// that is odd while it is being written, readers skip slots that change under them.
+class SlowQueryLog
+{
+public:
+	SlowQueryLog(void) : m_iHead(0)
+	{
+		for (int i = 0; i < SLOWLOG_SIZE; i++)
+			m_slots[i].sequence = 0;
+	}
+
+	void Record(const SlowQueryEntry& entry)
+	{
+		unsigned long long ticket = m_iHead.fetch_add(1, std::memory_order_relaxed);
+		Slot& slot = m_slots[ticket % SLOWLOG_SIZE];
+
+		slot.sequence.store(ticket * 2 + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		slot.entry = entry;
+		slot.sequence.store(ticket * 2 + 2, std::memory_order_release);
+	}
+
+	// Oldest first
+	void Snapshot(std::vector<SlowQueryEntry>& entries)
+	{
+		unsigned long long head = m_iHead.load(std::memory_order_acquire);
+		unsigned long long ticket = head > SLOWLOG_SIZE ? head - SLOWLOG_SIZE : 0;
+
+		for (; ticket < head; ticket++)
+		{
+			Slot& slot = m_slots[ticket % SLOWLOG_SIZE];
+
+			unsigned long long before = slot.sequence.load(std::memory_order_acquire);
+			if (before != ticket * 2 + 2)
+				continue;
+
+			SlowQueryEntry entry = slot.entry;
+			std::atomic_thread_fence(std::memory_order_acquire);
+
+			if (slot.sequence.load(std::memory_order_relaxed) == before)
+				entries.push_back(entry);
+		}
+	}
+
+private:
+	struct Slot
+	{
+		std::atomic<unsigned long long> sequence;
+		SlowQueryEntry entry;
+	};
+
+	std::atomic<unsigned long long> m_iHead;
+	Slot m_slots[SLOWLOG_SIZE];
+};
\ No newline at end of file
@@ -0,0 +1,160 @@
+#include "gm_tmysql.h"
+
+#include <algorithm>
+#include <cmath>
+
+StatementStatsTable statementStats;
+
+double StatementStats::GetPercentile(double percentile) const
+{
+	double target = calls * percentile;
+	double seen = 0;
+
+	for (int i = 0; i < STATS_BUCKETS; i++)
+	{
+		seen += histogram[i];
+
+		// Upper edge of the bucket, never past what was actually observed
+		if (seen >= target)
+			return std::min(ldexp(1.0, i) / 1000000.0, max);
+	}
+
+	return max;
+}
+
+void StatementStatsTable::Record(const std::string& query, double seconds, double rows, double bytes)
+{
+	std::string normalized = Normalize(query);
+	unsigned long long fingerprint = Hash(normalized);
+
+	int bucket = 0;
+	double micros = seconds * 1000000.0;
+	while (bucket < STATS_BUCKETS - 1 && ldexp(1.0, bucket) <= micros)
+		bucket++;
+
+	Shard& shard = m_shards[fingerprint % STATS_SHARDS];
+	std::lock_guard<std::mutex> guard(shard.mutex);
+
+	auto it = shard.stats.find(fingerprint);
+	if (it == shard.stats.end())
+	{
+		StatementStats stats;
+		stats.fingerprint = fingerprint;
+		stats.query.swap(normalized);
+		stats.calls = 0;
+		stats.total = 0;
+		stats.min = seconds;
+		stats.max = seconds;
+		stats.rows = 0;
+		stats.bytes = 0;
+		memset(stats.histogram, 0, sizeof(stats.histogram));
+
+		it = shard.stats.insert(std::make_pair(fingerprint, stats)).first;
+	}
+
+	StatementStats& stats = it->second;
+	stats.calls++;
+	stats.total += seconds;
+	stats.min = std::min(stats.min, seconds);
+	stats.max = std::max(stats.max, seconds);
+	stats.rows += rows;
+	stats.bytes += bytes;
+	stats.histogram[bucket]++;
+}
+
+void StatementStatsTable::Snapshot(std::vector<StatementStats>& stats)
+{
+	for (int i = 0; i < STATS_SHARDS; i++)
+	{
+		std::lock_guard<std::mutex> guard(m_shards[i].mutex);
+
+		for (auto iter = m_shards[i].stats.begin(); iter != m_shards[i].stats.end(); ++iter)
+			stats.push_back(iter->second);
+	}
+}
+
+void StatementStatsTable::Reset(void)
+{
+	for (int i = 0; i < STATS_SHARDS; i++)
+	{
+		std::lock_guard<std::mutex> guard(m_shards[i].mutex);
+		m_shards[i].stats.clear();
+	}
+}
+
+static bool IsIdentifierChar(char c)
+{
+	return isalnum((unsigned char)c) || c == '_' || c == '$' || c == '`';
+}
+
+std::string StatementStatsTable::Normalize(const std::string& query)
+{
+	std::string normalized;
+	normalized.reserve(query.length());
+
+	size_t len = query.length();
+	for (size_t i = 0; i < len;)
+	{
+		char c = query[i];
+
+		if (c == '\'' || c == '"')
+		{
+			// Skip to the closing quote, minding backslash escapes and doubled quotes
+			for (i++; i < len; i++)
+			{
+				if (query[i] == '\\')
+					i++;
+				else if (query[i] == c)
+				{
+					if (i + 1 < len && query[i + 1] == c)
+						i++;
+					else
+						break;
+				}
+			}
+
+			normalized.push_back('?');
+			i++;
+		}
+		else if (isdigit((unsigned char)c) && (normalized.empty() || !IsIdentifierChar(normalized[normalized.length() - 1])))
+		{
+			// Numbers, decimals, exponents and 0x literals
+			while (i < len && (isalnum((unsigned char)query[i]) || query[i] == '.'))
+				i++;
+
+			normalized.push_back('?');
+		}
+		else if (isspace((unsigned char)c))
+		{
+			while (i < len && isspace((unsigned char)query[i]))
+				i++;
+
+			if (!normalized.empty())
+				normalized.push_back(' ');
+		}
+		else
+		{
+			normalized.push_back(c);
+			i++;
+		}
+	}
+
+	if (!normalized.empty() && normalized[normalized.length() - 1] == ' ')
+		normalized.erase(normalized.length() - 1);
+
+	return normalized;
+}
+
+// 64-bit FNV-1a
+unsigned long long StatementStatsTable::Hash(const std::string& normalized)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < normalized.length(); i++)
+	{
+		hash ^= (unsigned char)normalized[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
\ No newline at end of file
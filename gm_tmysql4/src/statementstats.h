@@ -0,0 +1,55 @@
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#define STATS_SHARDS 16
+#define STATS_BUCKETS 32
+
+// Aggregate for every statement sharing a fingerprint
+struct StatementStats
+{
+	unsigned long long	fingerprint;
+	std::string			query;			// Normalized text
+	double				calls;
+	double				total;			// Seconds
+	double				min;
+	double				max;
+	double				rows;
+	double				bytes;
+	unsigned int		histogram[STATS_BUCKETS];	// Bucket i counts latencies below 2^i microseconds
+
+	double				GetPercentile(double percentile) const;
+};
+
+// pg_stat_statements style aggregation keyed by the hash of the normalized query text.
+// Workers normalize and record, the map is sharded so they rarely contend on a lock.
+class StatementStatsTable
+{
+public:
+	StatementStatsTable(void) : m_bEnabled(false) {}
+
+	void				SetEnabled(bool enabled) { m_bEnabled = enabled; }
+	bool				IsEnabled(void) { return m_bEnabled; }
+
+	void				Record(const std::string& query, double seconds, double rows, double bytes);
+	void				Snapshot(std::vector<StatementStats>& stats);
+	void				Reset(void);
+
+	// Literals become ?, whitespace runs a single space
+	static std::string	Normalize(const std::string& query);
+	static unsigned long long Hash(const std::string& normalized);
+
+private:
+	struct Shard
+	{
+		std::mutex		mutex;
+		std::unordered_map<unsigned long long, StatementStats> stats;
+	};
+
+	std::atomic<bool>	m_bEnabled;
+	Shard				m_shards[STATS_SHARDS];
+};
+
+extern StatementStatsTable statementStats;
\ No newline at end of file
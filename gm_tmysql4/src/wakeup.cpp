@@ -0,0 +1,94 @@
+#include "gm_tmysql.h"
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+Wakeup completionWakeup;
+
+void Wakeup::Notify(void)
+{
+	// Only the first notification since the last Consume has to touch the eventfd
+	if (m_iPending++ != 0)
+		return;
+
+#ifdef __linux__
+	int fd = m_iEventFD;
+	if (fd >= 0)
+	{
+		uint64_t one = 1;
+		ssize_t written = write(fd, &one, sizeof(one));
+		(void)written;
+	}
+#endif
+}
+
+bool Wakeup::Consume(void)
+{
+	if (m_iPending == 0)
+	{
+		if (!m_bDeadline || std::chrono::steady_clock::now() < m_deadline)
+			return false;
+	}
+
+	m_bDeadline = false;
+
+	// Drained first, a Notify landing in between is still covered by the walk that follows
+#ifdef __linux__
+	int fd = m_iEventFD;
+	if (fd >= 0)
+	{
+		uint64_t count;
+		ssize_t got = read(fd, &count, sizeof(count));
+		(void)got;
+	}
+#endif
+
+	m_iPending = 0;
+	return true;
+}
+
+// Keeps the earliest, whoever is still waiting after a poll sets theirs again
+void Wakeup::SetDeadline(std::chrono::steady_clock::time_point deadline)
+{
+	if (!m_bDeadline || deadline < m_deadline)
+		m_deadline = deadline;
+
+	m_bDeadline = true;
+}
+
+void Wakeup::Reset(void)
+{
+	m_iPending = 0;
+	m_bDeadline = false;
+}
+
+int Wakeup::GetEventFD(void)
+{
+#ifdef __linux__
+	if (m_iEventFD < 0)
+	{
+		m_iEventFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+		// Anything already pending would otherwise never be signalled
+		if (m_iPending != 0)
+		{
+			uint64_t one = 1;
+			ssize_t written = write(m_iEventFD, &one, sizeof(one));
+			(void)written;
+		}
+	}
+#endif
+
+	return m_iEventFD;
+}
+
+void Wakeup::CloseEventFD(void)
+{
+#ifdef __linux__
+	int fd = m_iEventFD.exchange(-1);
+	if (fd >= 0)
+		close(fd);
+#endif
+}
\ No newline at end of file
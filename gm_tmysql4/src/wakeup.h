@@ -0,0 +1,31 @@
+#include <atomic>
+#include <chrono>
+
+// Tells the main thread there is something to dispatch, so an idle poll is a single atomic load.
+// Workers call Notify after handing over a completion, the main thread calls Consume before walking
+// the databases. The optional eventfd lets another event loop wait on the same notifications.
+class Wakeup
+{
+public:
+	Wakeup(void) : m_iPending(0), m_iEventFD(-1), m_bDeadline(false) {}
+
+	void		Notify(void);
+
+	// Main thread only
+	bool		Consume(void);
+	void		SetDeadline(std::chrono::steady_clock::time_point deadline);
+	void		Reset(void);
+
+	// Created on first use, -1 where eventfd isn't available
+	int			GetEventFD(void);
+	void		CloseEventFD(void);
+
+private:
+	std::atomic<unsigned int> m_iPending;
+	std::atomic<int> m_iEventFD;
+
+	bool		m_bDeadline;
+	std::chrono::steady_clock::time_point m_deadline;
+};
+
+extern Wakeup completionWakeup;
\ No newline at end of file